@@ -4,24 +4,54 @@
 #include <raylib.h>
 #include <cmath>
 #include <raymath.h>
+#include <vector>
+#include <cstring>
 
 #include "utility/utility-core.hpp"
 
 #include "ray-tracing/cpu/rt_cpu.h"
+#include "ray-tracing/cpu/compiled_scene.h"
+#include "ray-tracing/cpu/render_session.h"
+#include "ray-tracing/cpu/benchmark.h"
 
 bool flipImage = false;
 
 Color convert_to_raylib_color(RAYTRACING::CPU::color color);
-void draw_image_to_screen(int x, int y, RAYTRACING::CPU::color* pixel_data, int width, int height, int samples_per_pixel);
-void draw_image_to_screen(int x, int y, RAYTRACING::CPU::PixelChunkData_t* pixel_data, int width, int height, int chunk_size);
-void draw_chunks_not_complete_to_screen(int x, int y, bool* render_chunk, int width, int height, int chunk_size);
-void draw_chunk_difference_to_screen(int x, int y, double* difference, double mutliplier, int width, int height, int chunk_size, bool print_stats = false);
-void draw_chunk_sample_temp_screen(int x, int y, RAYTRACING::CPU::PixelChunkData_t* data, bool* render_chunk, int width, int height, int chunk_size, float sample_count);
+
+/**
+ * Texture with a CPU side RGBA8 staging copy, used for the image and the chunk overlays.
+*/
+struct DisplayTexture_t
+{
+    Texture2D texture;
+    Color* pixels;
+    int width;
+    int height;
+
+    static DisplayTexture_t Build(int width, int height);
+    static void Free(DisplayTexture_t& display);
+};
+
+void update_image_texture(DisplayTexture_t& display, RAYTRACING::CPU::PixelChunkData_t* pixel_data, uint64_t* uploaded_epochs, bool upload_all, int width, int height, int chunk_size, const RAYTRACING::CPU::post_settings& settings);
+void update_chunks_not_complete_texture(DisplayTexture_t& display, bool* render_chunk);
+void update_chunk_difference_texture(DisplayTexture_t& display, double* difference, double mutliplier, bool print_stats = false);
+void update_chunk_sample_temp_texture(DisplayTexture_t& display, RAYTRACING::CPU::PixelChunkData_t* data, float sample_count);
+void draw_display_texture(int x, int y, DisplayTexture_t& display, int width, int height, int chunk_size);
 
 int main(int argc, char* argv[]) {
 
     Tracelog::Debug("Hello World");
 
+    // Headless acceleration structure benchmark: --benchmark [scene extent]
+    if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+        int extent = 11;
+        int parsedExtent;
+        if (argc > 2 && Utility::Numbers::parseInt(argv[2], parsedExtent) == EXIT_SUCCESS) extent = parsedExtent;
+
+        RAYTRACING::CPU::run_acceleration_benchmark(extent);
+        return EXIT_SUCCESS;
+    }
+
     int thread_limit = 10;
     Tracelog::Debug("Threads limit: %d / %d", thread_limit, (int)std::thread::hardware_concurrency());
 
@@ -33,8 +63,21 @@ int main(int argc, char* argv[]) {
     const int samplesPerPixel = 1;
     const int maxDepth = 10;
 
-    // World
-    hittable_list world = random_scene();
+    auto hasFlag = [&](const char* flag) {
+        for (int i = 1; i < argc; i++) {
+            if (std::string(argv[i]) == flag) return true;
+        }
+        return false;
+    };
+
+    // World, --instanced renders copies of one shared sphere cluster instead of the default scene
+    bool instancedScene = hasFlag("--instanced");
+    hittable_list world = instancedScene ? instanced_scene() : random_scene();
+    compiled_scene compiledWorld(world, bvh_build_method::binned_sah, thread_limit);
+
+    // --rebuild-bvh recompiles the scene with the linear bvh builder before every pass, for scenes whose objects move
+    bool rebuildBvhEveryPass = hasFlag("--rebuild-bvh");
+    if (rebuildBvhEveryPass) Tracelog::Debug("Rebuilding the bvh before every pass");
     point3 currentCameraPos = point3(13, 2, 3);
 
     double resScale = 4;
@@ -44,6 +87,7 @@ int main(int argc, char* argv[]) {
     int renderHeight = 256 * resScale;
 
     int screenWidth = renderWidth, screenHeight = renderHeight * 2;
+    SetConfigFlags(FLAG_VSYNC_HINT);
     InitWindow(screenWidth, screenHeight, "Ray Tracing");
     SetWindowPosition(100, 100);
 
@@ -53,117 +97,118 @@ int main(int argc, char* argv[]) {
     int maxRenderPixels = renderWidth * renderHeight;
     Tracelog::Debug("Max pixels: %d.", maxRenderPixels);
 
-    color* renderOutputPrimay = (color*)malloc(sizeof(color) * maxRenderPixels);
-    color* renderOutputSecondary = (color*)malloc(sizeof(color) * maxRenderPixels);
-
-    for (int i = 0; i < maxRenderPixels; i++) {
-        renderOutputPrimay[i] = color(0, 0, 0);
-        renderOutputSecondary[i] = color(0, 0, 0);
-    }
-
     long frameCount = 1;
 
     double differnceMult = 1;
 
-    double acceptableNoiseThreshold = 0.01;
+    // Per pixel variance stops single pixels, --half-buffer stops whole chunks by the even/odd sample estimate and wants a threshold around 0.06
+    bool halfBuffer = hasFlag("--half-buffer");
+    convergence_policy convergencePolicy = halfBuffer ? convergence_policy::half_buffer : convergence_policy::pixel_variance;
+    double acceptableNoiseThreshold = halfBuffer ? 0.06 : 0.01;
+    Tracelog::Info("Convergence policy: %s, threshold %.3f", halfBuffer ? "half buffer" : "pixel variance", acceptableNoiseThreshold);
     int maxSamples = 250;
+    // --wavefront traces all samples of a chunk bounce by bounce, path traces one sample at a time
+    integrator_mode integrator = hasFlag("--wavefront") ? integrator_mode::wavefront : integrator_mode::path;
+    const char* integratorName = integrator == integrator_mode::wavefront ? "wavefront" : "path";
 
     int chunkSize = 16;
     int chunksWide = std::ceil(renderWidth / (float)chunkSize);
     int chunksTall = std::ceil(renderHeight / (float)chunkSize);
-    int numberOfChunks = chunksWide * chunksTall;
-
-    //PixelChunkData_t* pixelDataPrimary = (PixelChunkData_t*)malloc(sizeof(PixelChunkData_t) * numberOfChunks);
-    //PixelChunkData_t* pixelDataSecondary = (PixelChunkData_t*)malloc(sizeof(PixelChunkData_t) * numberOfChunks);
-
-    PixelChunkData_t* pixelDataPrimary = PixelChunkData_t::Build(renderWidth, renderHeight, chunkSize);
-    PixelChunkData_t* pixelDataSecondary = PixelChunkData_t::Build(renderWidth, renderHeight, chunkSize);
-
-    double* chunkDifference = (double*)malloc(sizeof(double) * numberOfChunks);
-    bool* renderChunk = (bool*)malloc(sizeof(bool) * numberOfChunks);
-
-    //numberOfChunks = chunksWide; 
-
-    for (int i = 0; i < numberOfChunks; i++) {
-        chunkDifference[i] = 0;
-        renderChunk[i] = true;
-    }
 
     Tracelog::Debug("ChunkSize: %d,", chunkSize);
-    Tracelog::Debug("RenderWidth: %d, Therefore there render is %f chunks wide.", renderWidth, chunksWide);
-    Tracelog::Debug("renderHeight: %d, Therefore there render is %f chunks tall.", renderHeight, chunksTall);
+    Tracelog::Debug("RenderWidth: %d, Therefore there render is %d chunks wide.", renderWidth, chunksWide);
+    Tracelog::Debug("renderHeight: %d, Therefore there render is %d chunks tall.", renderHeight, chunksTall);
 
-    bool renderFinished = false;
+    // Passes run in the background, the window only shows the latest finished pass
+    RenderSession session(compiledWorld, renderWidth, renderHeight, chunkSize, maxDepth, maxSamples, acceptableNoiseThreshold, thread_limit, convergencePolicy);
+    if (rebuildBvhEveryPass) {
+        session.beforePass = [&]() { compiledWorld.compile(world, bvh_build_method::lbvh, thread_limit); };
+    }
+    // Passes of about this long keep the display updating while the noisiest chunks get most of the samples
+    session.scheduler.pass_budget_ms = 50;
+    session.integrator = integrator;
+
+    // Arrow keys orbit the camera around the look at point
+    const point3 cameraLookAt = point3(0, 0, 0);
+    double orbitAngle = std::atan2(currentCameraPos.z(), currentCameraPos.x());
+    double orbitRadius = std::hypot(currentCameraPos.x(), currentCameraPos.z());
+    double orbitHeight = currentCameraPos.y();
+
+    session.setCamera(currentCameraPos, cameraLookAt, vFov);
+    session.start();
+
+    // Display textures, the image only re-uploads chunks whose epoch changed
+    DisplayTexture_t imageTexture = DisplayTexture_t::Build(renderWidth, renderHeight);
+    DisplayTexture_t chunksNotCompleteTexture = DisplayTexture_t::Build(chunksWide, chunksTall);
+    std::vector<uint64_t> uploadedEpochs(chunksWide * chunksTall, 0);
+    uint64_t uploadedCameraVersion = 0;
+    int uploadedPassCount = -1;
+
+    // T cycles the tonemap, G the gamma curve, D toggles dithering, +/- change the exposure
+    post_settings postSettings;
+    const char* tonemapNames[] = { "none", "filmic", "aces" };
+    const char* gammaNames[] = { "gamma 2", "sRGB", "sRGB fast" };
 
     while (!WindowShouldClose()) {
         float deltaTime = GetFrameTime();
 
-        BeginDrawing();
-        ClearBackground(BLACK);
+        bool cameraMoved = false;
+        if (IsKeyDown(KEY_LEFT)) { orbitAngle -= deltaTime; cameraMoved = true; }
+        if (IsKeyDown(KEY_RIGHT)) { orbitAngle += deltaTime; cameraMoved = true; }
+        if (IsKeyDown(KEY_UP)) { orbitHeight += 4 * deltaTime; cameraMoved = true; }
+        if (IsKeyDown(KEY_DOWN)) { orbitHeight -= 4 * deltaTime; cameraMoved = true; }
 
-        // Render scene using software ray tracing
-
-        if (!renderFinished) {
-            renderWorldImageMCRT_ChunkWise(pixelDataPrimary, renderWidth, renderHeight, renderChunk, chunkSize, world, maxDepth, currentCameraPos, point3(0, 0, 0), vFov, thread_limit);
-        }
-
-        // Compute Chunked difference
-        if (frameCount > 1) {
-            computeChunkNoise(chunkDifference, pixelDataPrimary, numberOfChunks);
-            updateChunksToRender(renderChunk, pixelDataPrimary, maxSamples, acceptableNoiseThreshold, chunkDifference, numberOfChunks);
+        if (cameraMoved) {
+            currentCameraPos = point3(orbitRadius * std::cos(orbitAngle), orbitHeight, orbitRadius * std::sin(orbitAngle));
+            session.setCamera(currentCameraPos, cameraLookAt, vFov);
         }
 
-        // Visualisation of current
-        draw_image_to_screen(0, 0, pixelDataPrimary, renderWidth, renderHeight, chunkSize);
-        draw_chunks_not_complete_to_screen(0, renderHeight * 1, renderChunk, renderWidth, renderHeight, chunkSize);
-        //draw_chunk_difference_to_screen(0, renderHeight * 2, chunkDifference, differnceMult, renderWidth, renderHeight, chunkSize, !renderFinished);
+        bool postChanged = false;
+        if (IsKeyPressed(KEY_T)) { postSettings.tonemap = (tonemap_operator)(((int)postSettings.tonemap + 1) % 3); postChanged = true; }
+        if (IsKeyPressed(KEY_G)) { postSettings.gamma = (gamma_curve)(((int)postSettings.gamma + 1) % 3); postChanged = true; }
+        if (IsKeyPressed(KEY_D)) { postSettings.dither = !postSettings.dither; postChanged = true; }
+        if (IsKeyPressed(KEY_EQUAL)) { postSettings.exposure *= std::sqrt(2.0); postChanged = true; }
+        if (IsKeyPressed(KEY_MINUS)) { postSettings.exposure /= std::sqrt(2.0); postChanged = true; }
 
-        //draw_chunk_sample_temp_screen(0, renderHeight * 3, pixelDataPrimary, renderChunk, renderWidth, renderHeight, chunkSize, frameCount);
+        const RenderSnapshot& snapshot = session.latest();
+        frameCount = snapshot.passCount;
 
-        if (!renderFinished) {
-            int sum = 0;
-
-            for (int i = 0; i < numberOfChunks; i++) {
-                sum += pixelDataPrimary[i].number_of_samples;
-            }
-
-            Tracelog::Debug("Current sum of samples count: %d", sum);
+        BeginDrawing();
+        ClearBackground(BLACK);
 
-            sum = 0;
+        // Upload only when a new pass was published
+        if (snapshot.passCount > 0 && (snapshot.passCount != uploadedPassCount || snapshot.cameraVersion != uploadedCameraVersion || postChanged)) {
+            bool uploadAll = snapshot.cameraVersion != uploadedCameraVersion || postChanged;
+            update_image_texture(imageTexture, snapshot.chunks, uploadedEpochs.data(), uploadAll, renderWidth, renderHeight, chunkSize, postSettings);
+            update_chunks_not_complete_texture(chunksNotCompleteTexture, snapshot.renderChunk);
 
-            for (int i = 0; i < numberOfChunks; i++) {
-                sum += pixelDataSecondary[i].number_of_samples;
-            }
+            uploadedPassCount = snapshot.passCount;
+            uploadedCameraVersion = snapshot.cameraVersion;
+        }
 
-            Tracelog::Debug("Current sum of samples count: %d", sum);
+        // Visualisation of current
+        if (uploadedPassCount > 0) {
+            draw_display_texture(0, 0, imageTexture, renderWidth, renderHeight, 1);
+            draw_display_texture(0, renderHeight * 1, chunksNotCompleteTexture, renderWidth, renderHeight, chunkSize);
         }
-        
-        DrawText(TextFormat("Sample #%d", frameCount), 4, 4, 20, RED);
+        //update_chunk_difference_texture(chunkDifferenceTexture, chunkDifference, differnceMult, !renderFinished);
+        //draw_display_texture(0, renderHeight * 2, chunkDifferenceTexture, renderWidth, renderHeight, chunkSize);
 
-        EndDrawing();
+        //update_chunk_sample_temp_texture(chunkSampleTexture, pixelDataPrimary, frameCount);
+        //draw_display_texture(0, renderHeight * 3, chunkSampleTexture, renderWidth, renderHeight, chunkSize);
 
-        renderFinished = true;
-        for (int i = 0; i < numberOfChunks; i++) {
-            if (renderChunk[i]) {
-                renderFinished = false;
-                break;
-            }
-        }
+        DrawText(TextFormat("Sample #%d%s", frameCount, snapshot.finished ? " (done)" : ""), 4, 4, 20, RED);
+        DrawText(TextFormat("Pass: %.1f ms", snapshot.lastPassMs), 4, 28, 20, RED);
+        DrawText(TextFormat("Exposure x%.2f, %s, %s%s, %s", postSettings.exposure, tonemapNames[(int)postSettings.tonemap], gammaNames[(int)postSettings.gamma],
+            postSettings.dither ? ", dither" : "", integratorName), 4, 52, 20, RED);
 
-        if (!renderFinished) {
-            frameCount++;
-            //RAYTRACING::CPU::copyImage(renderOutputPrimay, renderOutputSecondary, maxRenderPixels);
-            RAYTRACING::CPU::copyImage(pixelDataPrimary, pixelDataSecondary, numberOfChunks);
-        }
+        EndDrawing();
     }
 
-    free(renderOutputPrimay);
-    free(renderOutputSecondary);
+    session.stop();
 
-    PixelChunkData_t::Free(pixelDataPrimary, renderWidth, renderHeight, chunkSize);
-    PixelChunkData_t::Free(pixelDataSecondary, renderWidth, renderHeight, chunkSize);
-    free(chunkDifference);
-    free(renderChunk);
+    DisplayTexture_t::Free(imageTexture);
+    DisplayTexture_t::Free(chunksNotCompleteTexture);
     CloseWindow();
 
     return EXIT_SUCCESS;
@@ -181,25 +226,37 @@ Color convert_to_raylib_color(RAYTRACING::CPU::color color)
     return color_v;
 }
 
-void draw_image_to_screen(int x, int y, RAYTRACING::CPU::color* pixel_data, int width, int height, int samples_per_pixel)
+DisplayTexture_t DisplayTexture_t::Build(int width, int height)
 {
-    using namespace RAYTRACING::CPU;
+    DisplayTexture_t display;
+    display.width = width;
+    display.height = height;
+    display.pixels = (Color*)malloc(sizeof(Color) * width * height);
 
-    int size = width * height;
+    for (int i = 0; i < width * height; i++) {
+        display.pixels[i] = BLACK;
+    }
 
-    for (int index = 0; index < size; index++) {
-        int px = index % width;
-        int py = index / width;
-        if (flipImage) py = height - py - 1; // Flip y coord
-        //py = height - py - 1; // Flip y coord
+    Image image = {
+        display.pixels,
+        width,
+        height,
+        1,
+        PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+    };
+    display.texture = LoadTextureFromImage(image);
 
-        color correctedColor = correct_color_and_gamma(pixel_data[index], samples_per_pixel);
+    return display;
+}
 
-        DrawPixel(x + px, y + py, convert_to_raylib_color(correctedColor));
-    }
+void DisplayTexture_t::Free(DisplayTexture_t& display)
+{
+    UnloadTexture(display.texture);
+    free(display.pixels);
+    display.pixels = nullptr;
 }
 
-void draw_image_to_screen(int x, int y, RAYTRACING::CPU::PixelChunkData_t* pixel_data, int width, int height, int chunk_size)
+void update_image_texture(DisplayTexture_t& display, RAYTRACING::CPU::PixelChunkData_t* pixel_data, uint64_t* uploaded_epochs, bool upload_all, int width, int height, int chunk_size, const RAYTRACING::CPU::post_settings& settings)
 {
     using namespace RAYTRACING::CPU;
 
@@ -207,82 +264,79 @@ void draw_image_to_screen(int x, int y, RAYTRACING::CPU::PixelChunkData_t* pixel
     const int chunks_tall = std::ceil(height / (float)chunk_size);
     const int numberOfChunks = chunks_wide * chunks_tall;
 
+    std::vector<int> dirtyChunks;
     for (int chunkIndex = 0; chunkIndex < numberOfChunks; chunkIndex++) {
+        if (upload_all || pixel_data[chunkIndex].epoch != uploaded_epochs[chunkIndex]) {
+            dirtyChunks.push_back(chunkIndex);
+            uploaded_epochs[chunkIndex] = pixel_data[chunkIndex].epoch;
+        }
+    }
 
+    if (dirtyChunks.empty()) return;
 
-        int cx = chunkIndex % chunks_wide;
-        int cy = chunkIndex / chunks_wide;
-
-        int start_y = cy * chunk_size;
+    // Convert the dirty chunks into the staging copy, in image row order
+    thread_pool::global().parallel_for((int)dirtyChunks.size(), [&](int i) {
+        int chunkIndex = dirtyChunks[i];
 
-        int start_x = cx * chunk_size;
+        int start_x = (chunkIndex % chunks_wide) * chunk_size;
+        int start_y = (chunkIndex / chunks_wide) * chunk_size;
 
-        int end_x = start_x + pixel_data[chunkIndex].width;
-        int end_y = start_y + pixel_data[chunkIndex].height;
+        const PixelChunkData_t& chunk = pixel_data[chunkIndex];
 
-        int index = 0;
-        for (int py = start_y; py < end_y; py++) {
+        for (int row = 0; row < chunk.height; row++) {
+            int py = start_y + row;
             int py_mod = py;
             if (flipImage) py_mod = height - py - 1; // Flip y coord
-            for (int px = start_x; px < end_x; px++) {
-                
-                color correctedColor = correct_color_and_gamma(pixel_data[chunkIndex].pixel_data[index], pixel_data[chunkIndex].number_of_samples);
-
-                
 
-                DrawPixel(x + px, y + py_mod, convert_to_raylib_color(correctedColor));
-                index++;
-            }
+            post_process_span(chunk.pixel_data + row * chunk.width, chunk.sample_counts + row * chunk.width, chunk.width, start_x, py_mod, settings,
+                (unsigned char*)(display.pixels + py_mod * width + start_x), 4);
         }
+    });
+
+    // Past a quarter of the chunks one full upload is cheaper than many small ones
+    if (dirtyChunks.size() * 4 > (size_t)numberOfChunks) {
+        UpdateTexture(display.texture, display.pixels);
+        return;
     }
-}
 
-void draw_chunks_not_complete_to_screen(int x, int y, bool* render_chunk, int width, int height, int chunk_size)
-{
-    int chunksWide = std::ceil(width / (float)chunk_size);
-    int chunksTall = std::ceil(height / (float)chunk_size);
-    int numberOfChunks = chunksWide * chunksTall;
+    std::vector<Color> chunkPixels(chunk_size * chunk_size);
 
-    for (int index = 0; index < numberOfChunks; index++) {
-        int start_x = (index % chunksWide) * chunk_size;
-        int start_y = (index / chunksWide) * chunk_size;
+    for (int chunkIndex : dirtyChunks) {
+        int start_x = (chunkIndex % chunks_wide) * chunk_size;
+        int start_y = (chunkIndex / chunks_wide) * chunk_size;
+        int chunkWidth = pixel_data[chunkIndex].width;
+        int chunkHeight = pixel_data[chunkIndex].height;
 
-        int end_y = std::min(height, start_y + chunk_size);
+        if (flipImage) start_y = height - start_y - chunkHeight;
 
-        int end_x = std::min(width, start_x + chunk_size);
+        for (int row = 0; row < chunkHeight; row++) {
+            memcpy(chunkPixels.data() + row * chunkWidth, display.pixels + (start_y + row) * width + start_x, sizeof(Color) * chunkWidth);
+        }
 
-        int chunkWidth = end_x - start_x;
-        int chunkHeight = end_y - start_y;
+        UpdateTextureRec(display.texture, Rectangle{ (float)start_x, (float)start_y, (float)chunkWidth, (float)chunkHeight }, chunkPixels.data());
+    }
+}
 
-        Color color = render_chunk[index] ? BLUE : GREEN;
+void update_chunks_not_complete_texture(DisplayTexture_t& display, bool* render_chunk)
+{
+    int numberOfChunks = display.width * display.height;
 
-        DrawRectangle(x + start_x, y + start_y, chunkWidth, chunkHeight, color);
+    for (int index = 0; index < numberOfChunks; index++) {
+        display.pixels[index] = render_chunk[index] ? BLUE : GREEN;
     }
+
+    UpdateTexture(display.texture, display.pixels);
 }
 
-void draw_chunk_difference_to_screen(int x, int y, double* difference, double multiplier, int width, int height, int chunk_size, bool print_stats)
+void update_chunk_difference_texture(DisplayTexture_t& display, double* difference, double multiplier, bool print_stats)
 {
-    int chunksWide = std::ceil(width / (float)chunk_size);
-    int chunksTall = std::ceil(height / (float)chunk_size);
-    int numberOfChunks = chunksWide * chunksTall;
-
-    
+    int numberOfChunks = display.width * display.height;
 
     double sumOfDifference = 0;
     double minAverageDifference = 1;
     double maxAverageDifference = 0;
 
     for (int index = 0; index < numberOfChunks; index++) {
-        int start_x = (index % chunksWide) * chunk_size;
-        int start_y = (index / chunksWide) * chunk_size;
-
-        int end_y = std::min(height, start_y + chunk_size);
-
-        int end_x = std::min(width, start_x + chunk_size);
-
-        int chunkWidth = end_x - start_x;
-        int chunkHeight = end_y - start_y;
-
         double diff = difference[index];
 
         sumOfDifference += diff;
@@ -290,11 +344,10 @@ void draw_chunk_difference_to_screen(int x, int y, double* difference, double mu
         if (diff > maxAverageDifference) maxAverageDifference = diff;
         if (diff < minAverageDifference) minAverageDifference = diff;
 
-        DrawRectangle(x + start_x, y + start_y, chunkWidth, chunkHeight, convert_to_raylib_color(RAYTRACING::CPU::color(1, 1, 1) * diff * multiplier));
+        display.pixels[index] = convert_to_raylib_color(RAYTRACING::CPU::color(1, 1, 1) * diff * multiplier);
     }
 
-
-    
+    UpdateTexture(display.texture, display.pixels);
 
     if (print_stats) {
         Tracelog::Debug("Number of chunks: %d", numberOfChunks);
@@ -305,27 +358,26 @@ void draw_chunk_difference_to_screen(int x, int y, double* difference, double mu
     }
 }
 
-void draw_chunk_sample_temp_screen(int x, int y, RAYTRACING::CPU::PixelChunkData_t* data, bool* render_chunk, int width, int height, int chunk_size, float sample_count)
+void update_chunk_sample_temp_texture(DisplayTexture_t& display, RAYTRACING::CPU::PixelChunkData_t* data, float sample_count)
 {
-
-    int chunksWide = std::ceil(width / (float)chunk_size);
-    int chunksTall = std::ceil(height / (float)chunk_size);
-    int numberOfChunks = chunksWide * chunksTall;
+    int numberOfChunks = display.width * display.height;
 
     for (int index = 0; index < numberOfChunks; index++) {
-        int start_x = (index % chunksWide) * chunk_size;
-        int start_y = (index / chunksWide) * chunk_size;
-
-        int end_y = std::min(height, start_y + chunk_size);
-
-        int end_x = std::min(width, start_x + chunk_size);
+        display.pixels[index] = convert_to_raylib_color(RAYTRACING::CPU::color(Lerp(0, 1, data[index].number_of_samples / sample_count), 0, Lerp(1, 0, data[index].number_of_samples / sample_count)));
+    }
 
-        int chunkWidth = end_x - start_x;
-        int chunkHeight = end_y - start_y;
+    UpdateTexture(display.texture, display.pixels);
+}
 
-        double scalar = render_chunk[index] ? 1 : 1;
+/**
+ * Draw a display texture over the render area. Chunk overlays have one texel per chunk and are scaled up,
+ * partial chunks at the right and bottom edge only show the part inside the image.
+ * @param texel_size Pixels per texel, 1 for the image and the chunk size for overlays
+*/
+void draw_display_texture(int x, int y, DisplayTexture_t& display, int width, int height, int texel_size)
+{
+    Rectangle source = { 0, 0, width / (float)texel_size, height / (float)texel_size };
+    Rectangle destination = { (float)x, (float)y, (float)width, (float)height };
 
-        DrawRectangle(x + start_x, y + start_y, chunkWidth, chunkHeight, convert_to_raylib_color(RAYTRACING::CPU::color(Lerp(0, 1, data[index].number_of_samples / sample_count), 0, Lerp(1, 0, data[index].number_of_samples / sample_count)) * scalar));
-        
-    }
+    DrawTexturePro(display.texture, source, destination, Vector2{ 0, 0 }, 0, WHITE);
 }
@@ -0,0 +1,102 @@
+#pragma once
+
+#ifndef AABB_H
+#define AABB_H
+
+#include "rtweekend.h"
+
+#include <utility>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Axis aligned bounding box. A default constructed box is empty (inverted) so it can be grown with expand().
+		*/
+		class aabb {
+		public:
+			aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+			/**
+			 * @param a Minimum corner
+			 * @param b Maximum corner
+			*/
+			aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+			point3 min() const { return minimum; }
+			point3 max() const { return maximum; }
+
+			point3 centroid() const {
+				return 0.5 * (minimum + maximum);
+			}
+
+			bool empty() const {
+				return minimum.x() > maximum.x() || minimum.y() > maximum.y() || minimum.z() > maximum.z();
+			}
+
+			void expand(const point3& p) {
+				for (int a = 0; a < 3; a++) {
+					minimum[a] = p[a] < minimum[a] ? p[a] : minimum[a];
+					maximum[a] = p[a] > maximum[a] ? p[a] : maximum[a];
+				}
+			}
+
+			void expand(const aabb& box) {
+				for (int a = 0; a < 3; a++) {
+					minimum[a] = box.minimum[a] < minimum[a] ? box.minimum[a] : minimum[a];
+					maximum[a] = box.maximum[a] > maximum[a] ? box.maximum[a] : maximum[a];
+				}
+			}
+
+			/**
+			 * Surface area of the box, used by the surface area heuristic. An empty box has no area.
+			*/
+			double surface_area() const {
+				if (empty()) return 0;
+				vec3 d = maximum - minimum;
+				return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+			}
+
+			/**
+			 * Slab test against a precomputed reciprocal ray direction.
+			 * @param origin Ray origin
+			 * @param inv_dir Component wise reciprocal of the ray direction
+			 * @param t_enter Set to the distance the ray enters the box
+			*/
+			bool hit(const point3& origin, const vec3& inv_dir, double t_min, double t_max, double& t_enter) const {
+				for (int a = 0; a < 3; a++) {
+					double t0 = (minimum[a] - origin[a]) * inv_dir[a];
+					double t1 = (maximum[a] - origin[a]) * inv_dir[a];
+					if (inv_dir[a] < 0.0) std::swap(t0, t1);
+					// Comparisons are written so that a NaN slab (axis parallel ray on the plane) is ignored
+					t_min = t0 > t_min ? t0 : t_min;
+					t_max = t1 < t_max ? t1 : t_max;
+					if (t_max < t_min)
+						return false;
+				}
+				t_enter = t_min;
+				return true;
+			}
+
+			bool hit(const ray& r, double t_min, double t_max) const {
+				vec3 d = r.direction();
+				vec3 inv_dir(1.0 / d.x(), 1.0 / d.y(), 1.0 / d.z());
+				double t_enter;
+				return hit(r.origin(), inv_dir, t_min, t_max, t_enter);
+			}
+
+		public:
+			point3 minimum;
+			point3 maximum;
+		};
+
+		inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+			aabb box = box0;
+			box.expand(box1);
+			return box;
+		}
+
+	}
+}
+
+#endif // !AABB_H
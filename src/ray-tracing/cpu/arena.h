@@ -0,0 +1,105 @@
+#pragma once
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Bump allocator that owns everything created in it and frees it all at once.
+		 * Memory comes in large blocks aligned to cache lines, so objects created one after another end up next to each other.
+		*/
+		class arena {
+		public:
+			static constexpr size_t block_alignment = 64;
+
+			/**
+			 * @param block_size Size of each block, larger requests get a block of their own
+			*/
+			arena(size_t block_size = 1 << 20) : default_block_size(block_size) {}
+			arena(const arena&) = delete;
+			arena& operator=(const arena&) = delete;
+			~arena() { clear(); }
+
+			void* allocate(size_t size, size_t alignment) {
+				size_t offset = (block_used + alignment - 1) & ~(alignment - 1);
+
+				if (blocks.empty() || offset + size > block_size) {
+					block_size = size + alignment > default_block_size ? size + alignment : default_block_size;
+					block_size = (block_size + block_alignment - 1) & ~(block_alignment - 1);
+
+					blocks.push_back(::operator new(block_size, std::align_val_t(block_alignment)));
+
+					block_used = 0;
+					offset = 0;
+				}
+
+				block_used = offset + size;
+				return (char*)blocks.back() + offset;
+			}
+
+			/**
+			 * Construct an object in the arena. Its destructor runs when the arena is cleared.
+			*/
+			template<typename T, typename... Args>
+			T* create(Args&&... args) {
+				T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+				if constexpr (!std::is_trivially_destructible_v<T>) {
+					destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+				}
+				return object;
+			}
+
+			/**
+			 * Uninitialized array of trivially copyable elements.
+			 * @param alignment Defaults to the cache line, so arrays that are walked by several threads do not share lines with their neighbours
+			*/
+			template<typename T>
+			T* allocate_array(size_t count, size_t alignment = block_alignment) {
+				static_assert(std::is_trivially_destructible_v<T>, "arena arrays do not run destructors");
+				if (count == 0) return nullptr;
+				return static_cast<T*>(allocate(sizeof(T) * count, alignment > alignof(T) ? alignment : alignof(T)));
+			}
+
+			/**
+			 * Destroy every object and release all blocks.
+			*/
+			void clear() {
+				for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) {
+					it->destroy(it->object);
+				}
+				destructors.clear();
+
+				for (void* block : blocks) {
+					::operator delete(block, std::align_val_t(block_alignment));
+				}
+				blocks.clear();
+				block_used = 0;
+				block_size = 0;
+			}
+
+		private:
+			struct destructor_entry {
+				void* object;
+				void (*destroy)(void*);
+			};
+
+			size_t default_block_size;
+			size_t block_size = 0;
+			size_t block_used = 0;
+			std::vector<void*> blocks;
+			std::vector<destructor_entry> destructors;
+		};
+
+	}
+}
+
+#endif // !ARENA_H
@@ -0,0 +1,226 @@
+#pragma once
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "rt_cpu.h"
+#include "bvh4.h"
+#include "compiled_scene.h"
+#include "sphere_soup.h"
+
+#include "../../utility/tracelog.hpp"
+
+#include <vector>
+#include <chrono>
+#include <typeinfo>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Sphere of its own type, so the benchmark can compile a scene of two primitive types and build and check the
+		 * variant path of basic_compiled_scene.
+		*/
+		class benchmark_sphere : public hittable {
+		public:
+			benchmark_sphere() {}
+			benchmark_sphere(const sphere& s) : geometry(s) {}
+
+			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override { return geometry.hit(r, t_min, t_max, rec); }
+			virtual bool bounding_box(aabb& output_box) const override { return geometry.bounding_box(output_box); }
+
+		public:
+			sphere geometry;
+		};
+
+		struct compiled_benchmark_sphere {
+			compiled_sphere geometry;
+			uint32_t material;
+		};
+
+		template<>
+		struct primitive_traits<benchmark_sphere> {
+			using compiled = compiled_benchmark_sphere;
+
+			static compiled_benchmark_sphere compile(const benchmark_sphere& s, uint32_t material) { return { primitive_traits<sphere>::compile(s.geometry, material), material }; }
+			static const material* material_of(const benchmark_sphere& s) { return primitive_traits<sphere>::material_of(s.geometry); }
+			static bool bounds(const benchmark_sphere& s, aabb& box) { return primitive_traits<sphere>::bounds(s.geometry, box); }
+
+			static RT_FORCE_INLINE bool intersect(const compiled_benchmark_sphere& s, const primitive_ray& pr, double t_min, double& closest) {
+				return primitive_traits<sphere>::intersect(s.geometry, pr, t_min, closest);
+			}
+
+			static RT_FORCE_INLINE void surface(const compiled_benchmark_sphere& s, const primitive_ray& pr, double t, hit_record& rec) {
+				primitive_traits<sphere>::surface(s.geometry, pr, t, rec);
+			}
+		};
+
+		/**
+		 * Collect the rays of one path per pixel (camera ray plus every scattered ray) so accelerators can be timed on identical work.
+		*/
+		std::vector<ray> benchmark_collect_rays(const hittable& world, const camera& cam, int image_width, int image_height, int max_depth) {
+			std::vector<ray> rays;
+			rays.reserve((size_t)image_width * image_height * 2);
+
+			for (int y = 0; y < image_height; y++) {
+				for (int x = 0; x < image_width; x++) {
+					ray r = cam.get_ray((x + random_double()) / (image_width - 1), (y + random_double()) / (image_height - 1));
+
+					for (int depth = 0; depth < max_depth; depth++) {
+						rays.push_back(r);
+
+						hit_record rec;
+						if (!world.hit(r, 0.001, infinity, rec)) break;
+
+						ray scattered;
+						color attenuation;
+						if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)) break;
+						r = scattered;
+					}
+				}
+			}
+
+			return rays;
+		}
+
+		/**
+		 * Time world.hit over a set of rays on the calling thread.
+		 * @return Rays per second
+		*/
+		double benchmark_hit_rate(const hittable& world, const std::vector<ray>& rays, int repeats, long long& hit_count) {
+			hit_record rec;
+			hit_count = 0;
+
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < repeats; i++) {
+				for (const ray& r : rays) {
+					if (world.hit(r, 0.001, infinity, rec)) hit_count++;
+				}
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			return (double)rays.size() * repeats / seconds;
+		}
+
+		/**
+		 * Material a hit is shaded with by scatter_hit, in packed form.
+		*/
+		inline packed_material benchmark_shaded_material(const hit_record& rec) {
+			if (rec.packed_mat && rec.packed_mat->type != material_type::virtual_call) return *rec.packed_mat;
+			return rec.mat_ptr->pack();
+		}
+
+		inline bool benchmark_same_material(const packed_material& a, const packed_material& b) {
+			return a.type == b.type && a.albedo.x() == b.albedo.x() && a.albedo.y() == b.albedo.y() && a.albedo.z() == b.albedo.z()
+				&& a.fuzz == b.fuzz && a.ir == b.ir;
+		}
+
+		/**
+		 * Count the rays whose closest hit differs between two hittables: whether they hit, the hit surface, and the material
+		 * the hit is shaded with, both through mat_ptr and through packed_mat as scatter_hit picks it.
+		 * Every structure over the same objects should give the exact hits of the plain list.
+		*/
+		long long benchmark_hit_mismatches(const hittable& reference, const hittable& candidate, const std::vector<ray>& rays) {
+			long long mismatches = 0;
+
+			for (const ray& r : rays) {
+				hit_record expected, actual;
+				bool expected_hit = reference.hit(r, 0.001, infinity, expected);
+				bool actual_hit = candidate.hit(r, 0.001, infinity, actual);
+
+				if (expected_hit != actual_hit) {
+					mismatches++;
+					continue;
+				}
+				if (!expected_hit) continue;
+
+				bool same_surface = expected.t == actual.t && expected.p.x() == actual.p.x() && expected.p.y() == actual.p.y() && expected.p.z() == actual.p.z()
+					&& expected.normal.x() == actual.normal.x() && expected.normal.y() == actual.normal.y() && expected.normal.z() == actual.normal.z()
+					&& expected.front_face == actual.front_face;
+
+				// Compiled scenes copy their materials, so compare them by type and parameters
+				bool same_material = typeid(*expected.mat_ptr) == typeid(*actual.mat_ptr)
+					&& benchmark_same_material(expected.mat_ptr->pack(), actual.mat_ptr->pack())
+					&& benchmark_same_material(benchmark_shaded_material(expected), benchmark_shaded_material(actual));
+
+				if (!same_surface || !same_material) mismatches++;
+			}
+
+			return mismatches;
+		}
+
+		/**
+		 * Compare the acceleration structures on random_scene() and log rays per second through Tracelog.
+		 * @param extent Grid extent passed to random_scene(), 11 is the default scene
+		*/
+		void run_acceleration_benchmark(int extent = 11, int image_width = 256, int image_height = 128, int repeats = 3) {
+			seed_random(1);
+			hittable_list world = random_scene(extent);
+
+			bvh binary(world);
+			bvh4 wide(binary);
+			compiled_scene compiled(world);
+
+			camera cam(point3(13, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 20.0, (double)image_width / image_height, 0.0, 10.0);
+			std::vector<ray> rays = benchmark_collect_rays(binary, cam, image_width, image_height, 10);
+
+			Tracelog::Info("Benchmark: %d objects, %d rays x %d repeats", (int)world.objects.size(), (int)rays.size(), repeats);
+
+			long long hits = 0;
+
+			// The linear scan is only worth running on small scenes, for timing and as the reference of the hit check
+			const bool small_scene = world.objects.size() <= 5000;
+
+			if (small_scene) {
+				double rate = benchmark_hit_rate(world, rays, repeats, hits);
+				Tracelog::Info("  hittable_list: %8.3f Mrays/s (%lld hits)", rate / 1e6, hits);
+			}
+
+			double binary_rate = benchmark_hit_rate(binary, rays, repeats, hits);
+			Tracelog::Info("  bvh          : %8.3f Mrays/s (%lld hits, %d nodes)", binary_rate / 1e6, hits, binary.node_count());
+
+			double wide_rate = benchmark_hit_rate(wide, rays, repeats, hits);
+			Tracelog::Info("  bvh4         : %8.3f Mrays/s (%lld hits, %d nodes)", wide_rate / 1e6, hits, wide.node_count());
+
+			double compiled_rate = benchmark_hit_rate(compiled, rays, repeats, hits);
+			Tracelog::Info("  compiled     : %8.3f Mrays/s (%lld hits, %d nodes)", compiled_rate / 1e6, hits, compiled.node_count);
+
+			Tracelog::Info("  bvh4 speedup over bvh: %.2fx", wide_rate / binary_rate);
+			Tracelog::Info("  compiled speedup over bvh4: %.2fx", compiled_rate / wide_rate);
+
+			// Every other sphere becomes a benchmark_sphere, for a compiled scene of two primitive types
+			hittable_list two_types;
+			for (size_t i = 0; i < world.objects.size(); i++) {
+				const sphere* s = dynamic_cast<const sphere*>(world.objects[i].get());
+				if (s && i % 2 == 1) two_types.add(make_shared<benchmark_sphere>(*s));
+				else two_types.add(world.objects[i]);
+			}
+			basic_compiled_scene<sphere, benchmark_sphere> compiled_two_types(two_types);
+
+			double two_types_rate = benchmark_hit_rate(compiled_two_types, rays, repeats, hits);
+			Tracelog::Info("  compiled, 2 primitive types: %8.3f Mrays/s (%lld hits, %d nodes)", two_types_rate / 1e6, hits, compiled_two_types.node_count);
+
+			if (!small_scene) {
+				Tracelog::Info("Hit check against hittable_list skipped, %d objects", (int)world.objects.size());
+				return;
+			}
+
+			// Every other sphere goes into a soup in front of the rest, so hits on plain spheres land in records that held soup hits
+			sphere_soup soup(world);
+			hittable_list soup_half, mixed;
+			for (size_t i = 0; i < world.objects.size(); i++) {
+				if (i % 2 == 0) soup_half.add(world.objects[i]);
+				else mixed.add(world.objects[i]);
+			}
+			mixed.objects.insert(mixed.objects.begin(), make_shared<sphere_soup>(soup_half));
+
+			Tracelog::Info("Hits differing from hittable_list: bvh %lld, bvh4 %lld, compiled %lld, compiled 2 types %lld, soup %lld, soup in list %lld",
+				benchmark_hit_mismatches(world, binary, rays), benchmark_hit_mismatches(world, wide, rays), benchmark_hit_mismatches(world, compiled, rays),
+				benchmark_hit_mismatches(world, compiled_two_types, rays), benchmark_hit_mismatches(world, soup, rays), benchmark_hit_mismatches(world, mixed, rays));
+		}
+
+	}
+}
+
+#endif // !BENCHMARK_H
@@ -0,0 +1,263 @@
+#pragma once
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh_builder.h"
+
+#include "../../utility/tracelog.hpp"
+
+#include <vector>
+#include <chrono>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		enum class bvh_build_method {
+			sah_sweep, // Full sweep SAH, best quality but single threaded
+			binned_sah, // Binned SAH split across worker threads
+			lbvh // Morton code linear BVH, lowest quality but fast enough to rebuild every frame
+		};
+
+		/**
+		 * Bounding volume hierarchy over the objects of a hittable_list.
+		 * Can be used anywhere a hittable is, it holds its own references to the objects.
+		*/
+		class bvh : public hittable {
+		public:
+			bvh() {}
+			/**
+			 * @param list Objects to build over
+			 * @param method Builder to use
+			 * @param thread_limit Maximum number of threads used by parallel builders, -1 for no limit
+			*/
+			bvh(const hittable_list& list, bvh_build_method method = bvh_build_method::binned_sah, int thread_limit = -1) {
+				build(list, method, thread_limit);
+			}
+
+			void build(const hittable_list& list, bvh_build_method method = bvh_build_method::binned_sah, int thread_limit = -1);
+
+			/**
+			 * Rebuild from scratch over the current primitives with the builder of the last build.
+			*/
+			void rebuild();
+
+			/**
+			 * Update the bounds after primitives have moved, keeping the topology. This is much cheaper than a build,
+			 * but the tree degrades as objects drift. When the SAH cost has grown past rebuild_cost_ratio times the cost
+			 * at the last full build, the tree is rebuilt instead. A bvh4 collapsed from this tree needs to be built again after either.
+			 * @return true if the tree was rebuilt
+			*/
+			bool refit(double rebuild_cost_ratio = 1.5);
+
+			int node_count() const { return (int)nodes.size(); }
+
+			double sah_cost() const { return bvh_sah_cost(nodes); }
+
+			/**
+			 * SAH cost relative to the last full build, 1 for a fresh tree.
+			*/
+			double sah_cost_ratio() const { return build_sah_cost > 0 ? sah_cost() / build_sah_cost : 1.0; }
+
+			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			virtual bool bounding_box(aabb& output_box) const override;
+
+		private:
+			void build(const std::vector<shared_ptr<hittable>>& objects, bvh_build_method method, int thread_limit);
+
+		public:
+			std::vector<bvh_node> nodes;
+			std::vector<shared_ptr<hittable>> primitives; // In leaf order
+
+			bvh_build_method build_method = bvh_build_method::binned_sah;
+			int build_thread_limit = -1;
+			double build_sah_cost = 0;
+
+			// Refit topology, filled in on the first refit after a build
+			std::vector<int> parents;
+			std::vector<int> leaves;
+		};
+
+		void bvh::build(const hittable_list& list, bvh_build_method method, int thread_limit) {
+			build(list.objects, method, thread_limit);
+		}
+
+		void bvh::rebuild() {
+			// Build reorders primitives, so it needs its own copy
+			std::vector<shared_ptr<hittable>> current = primitives;
+			build(current, build_method, build_thread_limit);
+		}
+
+		void bvh::build(const std::vector<shared_ptr<hittable>>& list_objects, bvh_build_method method, int thread_limit) {
+			auto start = std::chrono::steady_clock::now();
+
+			build_method = method;
+			build_thread_limit = thread_limit;
+			parents.clear();
+			leaves.clear();
+
+			std::vector<shared_ptr<hittable>> objects;
+			std::vector<aabb> bounds;
+
+			objects.reserve(list_objects.size());
+			bounds.reserve(list_objects.size());
+
+			// Objects without bounds (e.g. empty lists) can never be hit, so they are left out
+			aabb box;
+			for (const auto& object : list_objects) {
+				if (object->bounding_box(box)) {
+					objects.push_back(object);
+					bounds.push_back(box);
+				}
+			}
+
+			std::vector<int> order;
+			const char* method_name = "";
+
+			switch (method) {
+			case bvh_build_method::sah_sweep:
+				build_bvh_sah(bounds, nodes, order);
+				method_name = "SAH sweep";
+				break;
+			case bvh_build_method::binned_sah:
+				build_bvh_binned(bounds, nodes, order, thread_limit);
+				method_name = "binned SAH";
+				break;
+			case bvh_build_method::lbvh:
+				build_bvh_lbvh(bounds, nodes, order, thread_limit);
+				method_name = "LBVH";
+				break;
+			}
+
+			primitives.clear();
+			primitives.reserve(order.size());
+			for (int index : order) {
+				primitives.push_back(objects[index]);
+			}
+
+			build_sah_cost = sah_cost();
+
+			double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			Tracelog::Debug("BVH build (%s): %d primitives, %d nodes in %.2f ms", method_name, (int)primitives.size(), node_count(), build_ms);
+		}
+
+		bool bvh::refit(double rebuild_cost_ratio) {
+			if (nodes.empty()) return false;
+
+			auto start = std::chrono::steady_clock::now();
+
+			if (leaves.empty()) {
+				bvh_parents_and_leaves(nodes, parents, leaves);
+			}
+
+			// Small trees are not worth the thread start up
+			const int threads = leaves.size() >= (1 << 14) ? bvh_thread_count(build_thread_limit) : 1;
+
+			refit_bvh_parallel(nodes, parents, leaves, threads, [this](const bvh_node& leaf) {
+				aabb leaf_bounds, box;
+				for (int i = 0; i < leaf.primitive_count; i++) {
+					if (primitives[leaf.left_first + i]->bounding_box(box)) leaf_bounds.expand(box);
+				}
+				return leaf_bounds;
+			});
+
+			double ratio = sah_cost_ratio();
+			double refit_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			Tracelog::Debug("BVH refit: %d nodes in %.2f ms, SAH cost ratio %.2f", node_count(), refit_ms, ratio);
+
+			if (ratio > rebuild_cost_ratio) {
+				rebuild();
+				return true;
+			}
+
+			return false;
+		}
+
+		bool bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+			if (nodes.empty()) return false;
+
+			const point3 origin = r.origin();
+			const vec3 direction = r.direction();
+			const vec3 inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+
+			struct stack_entry {
+				int node_index;
+				double t_enter;
+			};
+
+			stack_entry stack[bvh_max_depth + 1];
+			int stack_size = 0;
+
+			double t_enter;
+			if (!nodes[0].bounds.hit(origin, inv_dir, t_min, t_max, t_enter)) return false;
+
+			bool hit_anything = false;
+			double closest_so_far = t_max;
+			stack[stack_size++] = { 0, t_enter };
+
+			while (stack_size > 0) {
+				stack_entry entry = stack[--stack_size];
+
+				// A closer hit may have been found since this node was pushed
+				if (entry.t_enter > closest_so_far) continue;
+
+				const bvh_node* node = &nodes[entry.node_index];
+
+				while (!node->is_leaf()) {
+					const int left = node->left_first;
+					double t_left, t_right;
+					bool hit_left = nodes[left].bounds.hit(origin, inv_dir, t_min, closest_so_far, t_left);
+					bool hit_right = nodes[left + 1].bounds.hit(origin, inv_dir, t_min, closest_so_far, t_right);
+
+					if (hit_left && hit_right) {
+						// Visit the nearer child first, the other one is deferred
+						if (t_right < t_left) {
+							stack[stack_size++] = { left, t_left };
+							node = &nodes[left + 1];
+						}
+						else {
+							stack[stack_size++] = { left + 1, t_right };
+							node = &nodes[left];
+						}
+					}
+					else if (hit_left) {
+						node = &nodes[left];
+					}
+					else if (hit_right) {
+						node = &nodes[left + 1];
+					}
+					else {
+						node = nullptr;
+						break;
+					}
+				}
+
+				if (node == nullptr) continue;
+
+				// Primitives only write to the record when they report a hit
+				for (int i = 0; i < node->primitive_count; i++) {
+					if (primitives[node->left_first + i]->hit(r, t_min, closest_so_far, rec)) {
+						hit_anything = true;
+						closest_so_far = rec.t;
+					}
+				}
+			}
+
+			return hit_anything;
+		}
+
+		bool bvh::bounding_box(aabb& output_box) const {
+			if (nodes.empty()) return false;
+			output_box = nodes[0].bounds;
+			return true;
+		}
+
+	}
+}
+
+#endif // !BVH_H
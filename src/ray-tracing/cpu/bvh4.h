@@ -0,0 +1,544 @@
+#pragma once
+
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "simd.h"
+
+#include <vector>
+#include <cfloat>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Node of a 4 wide BVH. Child bounds are stored as structure of arrays in float lanes so one SSE slab test covers all four children.
+		 * Unused slots have bounds at +infinity, so they can only pass the slab test for an unbounded ray.
+		*/
+		struct alignas(64) bvh4_node {
+			float min_x[4], min_y[4], min_z[4];
+			float max_x[4], max_y[4], max_z[4];
+			int child[4]; // Interior: node index. Leaf: first entry in the primitive list.
+			int primitive_count[4]; // Zero for interior children, -1 for unused slots
+		};
+
+		/**
+		 * 4 wide BVH collapsed from a binary bvh. Each node opens up the largest interior children of the binary tree until it has four,
+		 * and traversal visits the children that are hit front to back.
+		*/
+		class bvh4 : public hittable {
+		public:
+			bvh4() {}
+			bvh4(const bvh& binary) { build(binary); }
+
+			void build(const bvh& binary);
+
+			int node_count() const { return (int)nodes.size(); }
+
+			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			virtual void hit_packet(const ray* rays, int count, double t_min, double t_max, hit_record* recs, bool* hits) const override;
+			virtual bool bounding_box(aabb& output_box) const override;
+
+		public:
+			std::vector<bvh4_node> nodes;
+			std::vector<shared_ptr<hittable>> primitives; // In leaf order, same as the source bvh
+			aabb bounds;
+		};
+
+		/**
+		 * Collapse a binary node array into 4 wide nodes. Leaf children keep the primitive ranges of the binary leaves.
+		*/
+		void bvh4_collapse(const std::vector<bvh_node>& binary_nodes, std::vector<bvh4_node>& nodes) {
+			nodes.clear();
+			if (binary_nodes.empty()) return;
+
+			struct collapse_task {
+				int node_index;
+				int binary_index;
+			};
+
+			nodes.reserve(binary_nodes.size() / 2 + 1);
+			nodes.push_back(bvh4_node());
+
+			std::vector<collapse_task> tasks;
+			tasks.push_back({ 0, 0 });
+
+			while (!tasks.empty()) {
+				collapse_task task = tasks.back();
+				tasks.pop_back();
+
+				int children[4];
+				int child_count = 0;
+
+				const bvh_node& source = binary_nodes[task.binary_index];
+				if (source.is_leaf()) {
+					// Only happens for the root of a tiny scene
+					children[child_count++] = task.binary_index;
+				}
+				else {
+					children[child_count++] = source.left_first;
+					children[child_count++] = source.left_first + 1;
+				}
+
+				// Open up the interior child with the largest surface area until there are four children
+				while (child_count < 4) {
+					int best = -1;
+					double best_area = -1;
+
+					for (int i = 0; i < child_count; i++) {
+						const bvh_node& child = binary_nodes[children[i]];
+						if (!child.is_leaf() && child.bounds.surface_area() > best_area) {
+							best = i;
+							best_area = child.bounds.surface_area();
+						}
+					}
+
+					if (best == -1) break;
+
+					int left = binary_nodes[children[best]].left_first;
+					children[best] = left;
+					children[child_count++] = left + 1;
+				}
+
+				for (int slot = 0; slot < 4; slot++) {
+					bvh4_node& node = nodes[task.node_index];
+
+					if (slot >= child_count) {
+						const float inf = std::numeric_limits<float>::infinity();
+						node.min_x[slot] = node.min_y[slot] = node.min_z[slot] = inf;
+						node.max_x[slot] = node.max_y[slot] = node.max_z[slot] = inf;
+						node.child[slot] = 0;
+						node.primitive_count[slot] = -1;
+						continue;
+					}
+
+					const bvh_node& child = binary_nodes[children[slot]];
+
+					node.min_x[slot] = float_round_down(child.bounds.minimum.x());
+					node.min_y[slot] = float_round_down(child.bounds.minimum.y());
+					node.min_z[slot] = float_round_down(child.bounds.minimum.z());
+					node.max_x[slot] = float_round_up(child.bounds.maximum.x());
+					node.max_y[slot] = float_round_up(child.bounds.maximum.y());
+					node.max_z[slot] = float_round_up(child.bounds.maximum.z());
+
+					if (child.is_leaf()) {
+						node.child[slot] = child.left_first;
+						node.primitive_count[slot] = child.primitive_count;
+					}
+					else {
+						int index = (int)nodes.size();
+						node.child[slot] = index;
+						node.primitive_count[slot] = 0;
+
+						nodes.push_back(bvh4_node()); // Invalidates node
+						tasks.push_back({ index, children[slot] });
+					}
+				}
+			}
+		}
+
+		void bvh4::build(const bvh& binary) {
+			primitives = binary.primitives;
+			bounds = binary.nodes.empty() ? aabb() : binary.nodes[0].bounds;
+			bvh4_collapse(binary.nodes, nodes);
+		}
+
+		/**
+		 * Walk 4 wide nodes front to back and hand every leaf the ray reaches to intersect_leaf.
+		 * @param nodes Root first node array
+		 * @param node_count Number of nodes, the traversal does nothing for zero
+		 * @param closest_so_far Far limit of the ray, shrunk by the leaf callback as it finds hits
+		 * @param intersect_leaf Called as intersect_leaf(first, count, closest_so_far), returns true if it found a closer hit
+		 * @return true if any leaf reported a hit
+		*/
+		template<typename F>
+		bool bvh4_traverse(const bvh4_node* nodes, int node_count, const ray& r, double t_min, double& closest_so_far, F&& intersect_leaf) {
+			if (node_count == 0) return false;
+
+			const point3 origin = r.origin();
+			const vec3 direction = r.direction();
+
+			const float ox = (float)origin.x(), oy = (float)origin.y(), oz = (float)origin.z();
+			const float rdx = (float)(1.0 / direction.x()), rdy = (float)(1.0 / direction.y()), rdz = (float)(1.0 / direction.z());
+
+			// Near and far planes only depend on the direction signs, so pick them once per ray
+			const bool neg_x = rdx < 0, neg_y = rdy < 0, neg_z = rdz < 0;
+
+			// Widens the far distance by the worst case rounding error of the float slab test (Ize 2013)
+			const float robust_scale = 1.0f + 2.0f * (3.0f * FLT_EPSILON / 2.0f) / (1.0f - 3.0f * FLT_EPSILON / 2.0f);
+
+#if RT_SIMD_SSE
+			const __m128 ox4 = _mm_set1_ps(ox), oy4 = _mm_set1_ps(oy), oz4 = _mm_set1_ps(oz);
+			const __m128 rdx4 = _mm_set1_ps(rdx), rdy4 = _mm_set1_ps(rdy), rdz4 = _mm_set1_ps(rdz);
+			const __m128 t_min4 = _mm_set1_ps((float)t_min);
+			const __m128 robust4 = _mm_set1_ps(robust_scale);
+#endif
+
+			struct stack_entry {
+				int index;
+				int primitive_count;
+				float t_enter;
+			};
+
+			// Every level pushes at most three deferred children
+			stack_entry stack[3 * bvh_max_depth + 4];
+			int stack_size = 0;
+
+			bool hit_anything = false;
+
+			stack[stack_size++] = { 0, 0, (float)t_min };
+
+			while (stack_size > 0) {
+				stack_entry entry = stack[--stack_size];
+
+				if (entry.t_enter > closest_so_far) continue;
+
+				if (entry.primitive_count > 0) {
+					if (intersect_leaf(entry.index, entry.primitive_count, closest_so_far)) hit_anything = true;
+					continue;
+				}
+
+				const bvh4_node& node = nodes[entry.index];
+				const float t_far_limit = float_round_up(closest_so_far);
+
+				alignas(16) float t_enter[4];
+				int mask = 0;
+
+#if RT_SIMD_SSE
+				__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg_x ? node.max_x : node.min_x), ox4), rdx4);
+				__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg_x ? node.min_x : node.max_x), ox4), rdx4);
+				__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg_y ? node.max_y : node.min_y), oy4), rdy4);
+				__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg_y ? node.min_y : node.max_y), oy4), rdy4);
+				__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg_z ? node.max_z : node.min_z), oz4), rdz4);
+				__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(neg_z ? node.min_z : node.max_z), oz4), rdz4);
+
+				__m128 t_near = _mm_max_ps(_mm_max_ps(t0x, t0y), _mm_max_ps(t0z, t_min4));
+				__m128 t_far = _mm_mul_ps(_mm_min_ps(_mm_min_ps(t1x, t1y), t1z), robust4);
+				t_far = _mm_min_ps(t_far, _mm_set1_ps(t_far_limit));
+
+				mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+				_mm_store_ps(t_enter, t_near);
+#else
+				for (int i = 0; i < 4; i++) {
+					float t0x = ((neg_x ? node.max_x[i] : node.min_x[i]) - ox) * rdx;
+					float t1x = ((neg_x ? node.min_x[i] : node.max_x[i]) - ox) * rdx;
+					float t0y = ((neg_y ? node.max_y[i] : node.min_y[i]) - oy) * rdy;
+					float t1y = ((neg_y ? node.min_y[i] : node.max_y[i]) - oy) * rdy;
+					float t0z = ((neg_z ? node.max_z[i] : node.min_z[i]) - oz) * rdz;
+					float t1z = ((neg_z ? node.min_z[i] : node.max_z[i]) - oz) * rdz;
+
+					float t_near = std::max(std::max(t0x, t0y), std::max(t0z, (float)t_min));
+					float t_far = std::min(std::min(std::min(t1x, t1y), t1z) * robust_scale, t_far_limit);
+
+					if (t_near <= t_far) mask |= 1 << i;
+					t_enter[i] = t_near;
+				}
+#endif
+
+				if (mask == 0) continue;
+
+				// Sort the hit children by entry distance and push them far to near, so the nearest is popped first
+				int order[4];
+				int hits = 0;
+				for (int i = 0; i < 4; i++) {
+					// Unused slots pass the slab test when nothing has been hit yet and the far limit is infinite
+					if (!(mask & (1 << i)) || node.primitive_count[i] < 0) continue;
+
+					int j = hits++;
+					while (j > 0 && t_enter[order[j - 1]] > t_enter[i]) {
+						order[j] = order[j - 1];
+						j--;
+					}
+					order[j] = i;
+				}
+
+				for (int k = hits - 1; k >= 0; k--) {
+					int slot = order[k];
+					stack[stack_size++] = { node.child[slot], node.primitive_count[slot], t_enter[slot] };
+				}
+			}
+
+			return hit_anything;
+		}
+
+		/**
+		 * Walk 4 wide nodes front to back with a packet of rays, culling nodes by interval arithmetic: the origins and inverse
+		 * directions of the packet are bounded per axis, and a child is visited if its slab test can pass for some ray within
+		 * those bounds. Float rounding is monotonic, so the bounds hold for each ray's own float slab test as well.
+		 * Every ray takes its own slab test at the leaves, so it is handed the same leaves as by bvh4_traverse while the
+		 * node tests above them are shared by the packet. Packets whose directions differ in sign on some axis have no
+		 * common near planes and are traced ray by ray, as are all packets when the tree is a single node.
+		 * @param count Rays in the packet, at most ray_packet_size. An empty packet does nothing
+		 * @param closest_so_far Far limit of each ray, shrunk by the leaf callback as it finds hits
+		 * @param hits Set to whether each ray had a hit reported
+		 * @param intersect_leaf Called as intersect_leaf(ray_index, first, count, closest_so_far[ray_index]), returns true if it found a closer hit
+		*/
+		template<typename F>
+		void bvh4_traverse_packet(const bvh4_node* nodes, int node_count, const ray* rays, int count, double t_min, double* closest_so_far, bool* hits, F&& intersect_leaf) {
+			for (int i = 0; i < count; i++) hits[i] = false;
+			if (node_count == 0 || count <= 0) return;
+
+			auto trace_each = [&]() {
+				for (int i = 0; i < count; i++) {
+					hits[i] = bvh4_traverse(nodes, node_count, rays[i], t_min, closest_so_far[i], [&](int first, int primitives, double& closest) {
+						return intersect_leaf(i, first, primitives, closest);
+					});
+				}
+			};
+
+			// With only the root there are no node tests to share
+			if (node_count == 1) {
+				trace_each();
+				return;
+			}
+
+			// Rays in structure of arrays layout, padded to groups of four by copies of the first ray that never pass a test
+			const int padded_count = (count + 3) & ~3;
+			alignas(16) float ox[ray_packet_size], oy[ray_packet_size], oz[ray_packet_size];
+			alignas(16) float rdx[ray_packet_size], rdy[ray_packet_size], rdz[ray_packet_size];
+			alignas(16) float ray_far[ray_packet_size]; // Rounded up closest_so_far, -infinity for padding
+
+			bool coherent = true;
+			for (int i = 0; i < padded_count; i++) {
+				const int source = i < count ? i : 0;
+				const point3 origin = rays[source].origin();
+				const vec3 direction = rays[source].direction();
+
+				ox[i] = (float)origin.x(); oy[i] = (float)origin.y(); oz[i] = (float)origin.z();
+				rdx[i] = (float)(1.0 / direction.x()); rdy[i] = (float)(1.0 / direction.y()); rdz[i] = (float)(1.0 / direction.z());
+				ray_far[i] = i < count ? float_round_up(closest_so_far[i]) : -std::numeric_limits<float>::infinity();
+
+				if (!std::isfinite(rdx[i]) || !std::isfinite(rdy[i]) || !std::isfinite(rdz[i])) coherent = false;
+				if ((rdx[i] < 0) != (rdx[0] < 0) || (rdy[i] < 0) != (rdy[0] < 0) || (rdz[i] < 0) != (rdz[0] < 0)) coherent = false;
+			}
+
+			if (!coherent) {
+				trace_each();
+				return;
+			}
+
+			const bool neg_x = rdx[0] < 0, neg_y = rdy[0] < 0, neg_z = rdz[0] < 0;
+
+			// Per axis bounds of the packet: the origin that makes the near plane closest and the far plane farthest, and the inverse directions
+			float near_ox = ox[0], near_oy = oy[0], near_oz = oz[0];
+			float far_ox = ox[0], far_oy = oy[0], far_oz = oz[0];
+			float rdx_lo = rdx[0], rdy_lo = rdy[0], rdz_lo = rdz[0];
+			float rdx_hi = rdx[0], rdy_hi = rdy[0], rdz_hi = rdz[0];
+			for (int i = 1; i < count; i++) {
+				// A positive direction meets its near plane soonest from the largest origin, a negative one from the smallest
+				near_ox = neg_x ? std::min(near_ox, ox[i]) : std::max(near_ox, ox[i]);
+				near_oy = neg_y ? std::min(near_oy, oy[i]) : std::max(near_oy, oy[i]);
+				near_oz = neg_z ? std::min(near_oz, oz[i]) : std::max(near_oz, oz[i]);
+				far_ox = neg_x ? std::max(far_ox, ox[i]) : std::min(far_ox, ox[i]);
+				far_oy = neg_y ? std::max(far_oy, oy[i]) : std::min(far_oy, oy[i]);
+				far_oz = neg_z ? std::max(far_oz, oz[i]) : std::min(far_oz, oz[i]);
+				rdx_lo = std::min(rdx_lo, rdx[i]); rdy_lo = std::min(rdy_lo, rdy[i]); rdz_lo = std::min(rdz_lo, rdz[i]);
+				rdx_hi = std::max(rdx_hi, rdx[i]); rdy_hi = std::max(rdy_hi, rdy[i]); rdz_hi = std::max(rdz_hi, rdz[i]);
+			}
+
+			const float robust_scale = 1.0f + 2.0f * (3.0f * FLT_EPSILON / 2.0f) / (1.0f - 3.0f * FLT_EPSILON / 2.0f);
+
+#if RT_SIMD_SSE
+			const __m128 near_ox4 = _mm_set1_ps(near_ox), near_oy4 = _mm_set1_ps(near_oy), near_oz4 = _mm_set1_ps(near_oz);
+			const __m128 far_ox4 = _mm_set1_ps(far_ox), far_oy4 = _mm_set1_ps(far_oy), far_oz4 = _mm_set1_ps(far_oz);
+			const __m128 rdx_lo4 = _mm_set1_ps(rdx_lo), rdy_lo4 = _mm_set1_ps(rdy_lo), rdz_lo4 = _mm_set1_ps(rdz_lo);
+			const __m128 rdx_hi4 = _mm_set1_ps(rdx_hi), rdy_hi4 = _mm_set1_ps(rdy_hi), rdz_hi4 = _mm_set1_ps(rdz_hi);
+			const __m128 t_min4 = _mm_set1_ps((float)t_min);
+			const __m128 robust4 = _mm_set1_ps(robust_scale);
+#endif
+
+			struct stack_entry {
+				int index;
+				int primitive_count;
+				float t_enter;
+				int box; // Leaves: parent node * 4 + slot, where the leaf's bounds are
+			};
+
+			stack_entry stack[3 * bvh_max_depth + 4];
+			int stack_size = 0;
+
+			// Far limit of the packet, the farthest of its rays
+			double packet_closest = closest_so_far[0];
+			for (int i = 1; i < count; i++) packet_closest = std::max(packet_closest, closest_so_far[i]);
+
+			stack[stack_size++] = { 0, 0, (float)t_min, 0 };
+
+			while (stack_size > 0) {
+				stack_entry entry = stack[--stack_size];
+
+				if (entry.t_enter > packet_closest) continue;
+
+				if (entry.primitive_count > 0) {
+					const bvh4_node& parent = nodes[entry.box / 4];
+					const int slot = entry.box % 4;
+
+					const float x0 = neg_x ? parent.max_x[slot] : parent.min_x[slot], x1 = neg_x ? parent.min_x[slot] : parent.max_x[slot];
+					const float y0 = neg_y ? parent.max_y[slot] : parent.min_y[slot], y1 = neg_y ? parent.min_y[slot] : parent.max_y[slot];
+					const float z0 = neg_z ? parent.max_z[slot] : parent.min_z[slot], z1 = neg_z ? parent.min_z[slot] : parent.max_z[slot];
+
+					// The same slab test as bvh4_traverse, for each ray of the packet
+					int leaf_mask = 0;
+#if RT_SIMD_SSE
+					const __m128 x04 = _mm_set1_ps(x0), x14 = _mm_set1_ps(x1);
+					const __m128 y04 = _mm_set1_ps(y0), y14 = _mm_set1_ps(y1);
+					const __m128 z04 = _mm_set1_ps(z0), z14 = _mm_set1_ps(z1);
+					for (int g = 0; g < padded_count; g += 4) {
+						const __m128 ox4 = _mm_load_ps(ox + g), oy4 = _mm_load_ps(oy + g), oz4 = _mm_load_ps(oz + g);
+						const __m128 rdx4 = _mm_load_ps(rdx + g), rdy4 = _mm_load_ps(rdy + g), rdz4 = _mm_load_ps(rdz + g);
+
+						__m128 t0x = _mm_mul_ps(_mm_sub_ps(x04, ox4), rdx4), t1x = _mm_mul_ps(_mm_sub_ps(x14, ox4), rdx4);
+						__m128 t0y = _mm_mul_ps(_mm_sub_ps(y04, oy4), rdy4), t1y = _mm_mul_ps(_mm_sub_ps(y14, oy4), rdy4);
+						__m128 t0z = _mm_mul_ps(_mm_sub_ps(z04, oz4), rdz4), t1z = _mm_mul_ps(_mm_sub_ps(z14, oz4), rdz4);
+
+						__m128 t_near = _mm_max_ps(_mm_max_ps(t0x, t0y), _mm_max_ps(t0z, t_min4));
+						__m128 t_far = _mm_mul_ps(_mm_min_ps(_mm_min_ps(t1x, t1y), t1z), robust4);
+						t_far = _mm_min_ps(t_far, _mm_load_ps(ray_far + g));
+
+						leaf_mask |= _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) << g;
+					}
+#else
+					for (int i = 0; i < count; i++) {
+						float t0x = (x0 - ox[i]) * rdx[i], t1x = (x1 - ox[i]) * rdx[i];
+						float t0y = (y0 - oy[i]) * rdy[i], t1y = (y1 - oy[i]) * rdy[i];
+						float t0z = (z0 - oz[i]) * rdz[i], t1z = (z1 - oz[i]) * rdz[i];
+
+						float t_near = std::max(std::max(t0x, t0y), std::max(t0z, (float)t_min));
+						float t_far = std::min(std::min(std::min(t1x, t1y), t1z) * robust_scale, ray_far[i]);
+						if (t_near <= t_far) leaf_mask |= 1 << i;
+					}
+#endif
+
+					if (leaf_mask == 0) continue;
+
+					bool hit_leaf = false;
+					for (int i = 0; i < count; i++) {
+						if (!(leaf_mask & (1 << i))) continue;
+						if (!intersect_leaf(i, entry.index, entry.primitive_count, closest_so_far[i])) continue;
+
+						hits[i] = true;
+						ray_far[i] = float_round_up(closest_so_far[i]);
+						hit_leaf = true;
+					}
+
+					if (hit_leaf) {
+						packet_closest = closest_so_far[0];
+						for (int i = 1; i < count; i++) packet_closest = std::max(packet_closest, closest_so_far[i]);
+					}
+					continue;
+				}
+
+				const bvh4_node& node = nodes[entry.index];
+				const float t_far_limit = float_round_up(packet_closest);
+
+				alignas(16) float t_enter[4];
+				int mask = 0;
+
+#if RT_SIMD_SSE
+				// Interval products: the near distance is bounded below and the far distance above over the packet's inverse directions
+				__m128 dx0 = _mm_sub_ps(_mm_load_ps(neg_x ? node.max_x : node.min_x), near_ox4);
+				__m128 dx1 = _mm_sub_ps(_mm_load_ps(neg_x ? node.min_x : node.max_x), far_ox4);
+				__m128 dy0 = _mm_sub_ps(_mm_load_ps(neg_y ? node.max_y : node.min_y), near_oy4);
+				__m128 dy1 = _mm_sub_ps(_mm_load_ps(neg_y ? node.min_y : node.max_y), far_oy4);
+				__m128 dz0 = _mm_sub_ps(_mm_load_ps(neg_z ? node.max_z : node.min_z), near_oz4);
+				__m128 dz1 = _mm_sub_ps(_mm_load_ps(neg_z ? node.min_z : node.max_z), far_oz4);
+
+				__m128 t0x = _mm_min_ps(_mm_mul_ps(dx0, rdx_lo4), _mm_mul_ps(dx0, rdx_hi4));
+				__m128 t1x = _mm_max_ps(_mm_mul_ps(dx1, rdx_lo4), _mm_mul_ps(dx1, rdx_hi4));
+				__m128 t0y = _mm_min_ps(_mm_mul_ps(dy0, rdy_lo4), _mm_mul_ps(dy0, rdy_hi4));
+				__m128 t1y = _mm_max_ps(_mm_mul_ps(dy1, rdy_lo4), _mm_mul_ps(dy1, rdy_hi4));
+				__m128 t0z = _mm_min_ps(_mm_mul_ps(dz0, rdz_lo4), _mm_mul_ps(dz0, rdz_hi4));
+				__m128 t1z = _mm_max_ps(_mm_mul_ps(dz1, rdz_lo4), _mm_mul_ps(dz1, rdz_hi4));
+
+				__m128 t_near = _mm_max_ps(_mm_max_ps(t0x, t0y), _mm_max_ps(t0z, t_min4));
+				__m128 t_far = _mm_mul_ps(_mm_min_ps(_mm_min_ps(t1x, t1y), t1z), robust4);
+				t_far = _mm_min_ps(t_far, _mm_set1_ps(t_far_limit));
+
+				mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+				_mm_store_ps(t_enter, t_near);
+#else
+				for (int i = 0; i < 4; i++) {
+					float dx0 = (neg_x ? node.max_x[i] : node.min_x[i]) - near_ox, dx1 = (neg_x ? node.min_x[i] : node.max_x[i]) - far_ox;
+					float dy0 = (neg_y ? node.max_y[i] : node.min_y[i]) - near_oy, dy1 = (neg_y ? node.min_y[i] : node.max_y[i]) - far_oy;
+					float dz0 = (neg_z ? node.max_z[i] : node.min_z[i]) - near_oz, dz1 = (neg_z ? node.min_z[i] : node.max_z[i]) - far_oz;
+
+					float t0x = std::min(dx0 * rdx_lo, dx0 * rdx_hi), t1x = std::max(dx1 * rdx_lo, dx1 * rdx_hi);
+					float t0y = std::min(dy0 * rdy_lo, dy0 * rdy_hi), t1y = std::max(dy1 * rdy_lo, dy1 * rdy_hi);
+					float t0z = std::min(dz0 * rdz_lo, dz0 * rdz_hi), t1z = std::max(dz1 * rdz_lo, dz1 * rdz_hi);
+
+					float t_near = std::max(std::max(t0x, t0y), std::max(t0z, (float)t_min));
+					float t_far = std::min(std::min(std::min(t1x, t1y), t1z) * robust_scale, t_far_limit);
+
+					if (t_near <= t_far) mask |= 1 << i;
+					t_enter[i] = t_near;
+				}
+#endif
+
+				if (mask == 0) continue;
+
+				int order[4];
+				int hit_children = 0;
+				for (int i = 0; i < 4; i++) {
+					if (!(mask & (1 << i)) || node.primitive_count[i] < 0) continue;
+
+					int j = hit_children++;
+					while (j > 0 && t_enter[order[j - 1]] > t_enter[i]) {
+						order[j] = order[j - 1];
+						j--;
+					}
+					order[j] = i;
+				}
+
+				for (int k = hit_children - 1; k >= 0; k--) {
+					int slot = order[k];
+					stack[stack_size++] = { node.child[slot], node.primitive_count[slot], t_enter[slot], entry.index * 4 + slot };
+				}
+			}
+		}
+
+		bool bvh4::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+			double closest_so_far = t_max;
+
+			return bvh4_traverse(nodes.data(), node_count(), r, t_min, closest_so_far, [&](int first, int count, double& closest) {
+				// Primitives only write to the record when they report a hit
+				bool hit_leaf = false;
+				for (int i = 0; i < count; i++) {
+					if (primitives[first + i]->hit(r, t_min, closest, rec)) {
+						hit_leaf = true;
+						closest = rec.t;
+					}
+				}
+				return hit_leaf;
+			});
+		}
+
+		void bvh4::hit_packet(const ray* rays, int count, double t_min, double t_max, hit_record* recs, bool* hits) const {
+			double closest_so_far[ray_packet_size];
+			for (int i = 0; i < count; i++) closest_so_far[i] = t_max;
+
+			bvh4_traverse_packet(nodes.data(), node_count(), rays, count, t_min, closest_so_far, hits, [&](int ray_index, int first, int primitives_in_leaf, double& closest) {
+				bool hit_leaf = false;
+				for (int i = 0; i < primitives_in_leaf; i++) {
+					if (primitives[first + i]->hit(rays[ray_index], t_min, closest, recs[ray_index])) {
+						hit_leaf = true;
+						closest = recs[ray_index].t;
+					}
+				}
+				return hit_leaf;
+			});
+		}
+
+		bool bvh4::bounding_box(aabb& output_box) const {
+			if (nodes.empty()) return false;
+			output_box = bounds;
+			return true;
+		}
+
+	}
+}
+
+#endif // !BVH4_H
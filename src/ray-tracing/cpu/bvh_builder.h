@@ -0,0 +1,972 @@
+#pragma once
+
+#ifndef BVH_BUILDER_H
+#define BVH_BUILDER_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "thread_pool.h"
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <bit>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		// SAH constants, costs are relative to a single primitive intersection
+		const double bvh_traversal_cost = 1.0;
+		const double bvh_intersection_cost = 1.0;
+		const int bvh_max_leaf_size = 4;
+		const int bvh_max_depth = 128; // LBVH trees are bounded by the 63 bit code plus 31 bits of duplicate index
+		const int bvh_bin_count = 16;
+
+		/**
+		 * Node of a flattened binary BVH.
+		 * The two children of an interior node are stored next to each other, so only the index of the left child is kept.
+		*/
+		struct bvh_node {
+			aabb bounds;
+			int left_first; // Interior: index of the left child (right is left_first + 1). Leaf: first entry in the primitive list.
+			int primitive_count; // Zero for interior nodes
+
+			bool is_leaf() const { return primitive_count > 0; }
+		};
+
+		/**
+		 * Build a BVH over a set of primitive bounds with a full sweep of the surface area heuristic.
+		 * Primitives are presorted along each axis once and the sorted lists are stably partitioned at every split,
+		 * so the build is O(n log n).
+		 * @param primitive_bounds Bounds of each primitive
+		 * @param nodes Output nodes, the root is node 0
+		 * @param primitive_indices Output primitive order, leaves reference ranges of this list
+		*/
+		void build_bvh_sah(const std::vector<aabb>& primitive_bounds, std::vector<bvh_node>& nodes, std::vector<int>& primitive_indices) {
+			const int count = (int)primitive_bounds.size();
+
+			nodes.clear();
+			primitive_indices.clear();
+
+			if (count == 0) return;
+
+			std::vector<point3> centroids(count);
+			for (int i = 0; i < count; i++) {
+				centroids[i] = primitive_bounds[i].centroid();
+			}
+
+			// One index list per axis, each sorted by centroid along that axis
+			std::vector<int> sorted[3];
+			for (int axis = 0; axis < 3; axis++) {
+				sorted[axis].resize(count);
+				for (int i = 0; i < count; i++) sorted[axis][i] = i;
+
+				std::sort(sorted[axis].begin(), sorted[axis].end(), [&centroids, axis](int a, int b) {
+					if (centroids[a][axis] != centroids[b][axis]) return centroids[a][axis] < centroids[b][axis];
+					return a < b;
+				});
+			}
+
+			std::vector<double> right_area(count);
+			std::vector<char> in_left(count);
+			std::vector<int> scratch(count);
+
+			struct build_task {
+				int node_index;
+				int begin;
+				int end;
+				int depth;
+			};
+
+			nodes.reserve(2 * count);
+			nodes.push_back(bvh_node());
+
+			std::vector<build_task> tasks;
+			tasks.push_back({ 0, 0, count, 0 });
+
+			while (!tasks.empty()) {
+				build_task task = tasks.back();
+				tasks.pop_back();
+
+				const int n = task.end - task.begin;
+
+				aabb node_bounds;
+				for (int i = task.begin; i < task.end; i++) {
+					node_bounds.expand(primitive_bounds[sorted[0][i]]);
+				}
+				nodes[task.node_index].bounds = node_bounds;
+
+				const double leaf_cost = bvh_intersection_cost * n;
+				const double parent_area = node_bounds.surface_area();
+
+				// Sweep every axis for the cheapest split
+				int best_axis = -1;
+				int best_split = 0; // Number of primitives going left
+				double best_cost = infinity;
+
+				if (n > 1 && task.depth < bvh_max_depth) {
+					for (int axis = 0; axis < 3; axis++) {
+						const int* order = sorted[axis].data() + task.begin;
+
+						aabb right_bounds;
+						for (int i = n - 1; i > 0; i--) {
+							right_bounds.expand(primitive_bounds[order[i]]);
+							right_area[i] = right_bounds.surface_area();
+						}
+
+						aabb left_bounds;
+						for (int i = 1; i < n; i++) {
+							left_bounds.expand(primitive_bounds[order[i - 1]]);
+
+							double cost = left_bounds.surface_area() * i + right_area[i] * (n - i);
+							if (cost < best_cost) {
+								best_cost = cost;
+								best_axis = axis;
+								best_split = i;
+							}
+						}
+					}
+
+					if (parent_area > 0) {
+						best_cost = bvh_traversal_cost + bvh_intersection_cost * best_cost / parent_area;
+					}
+					else {
+						// Every primitive is a point, fall back to a median split
+						best_cost = 0;
+						best_axis = 0;
+						best_split = n / 2;
+					}
+				}
+
+				bool make_leaf = best_axis == -1 || (best_cost >= leaf_cost && n <= bvh_max_leaf_size);
+
+				if (make_leaf) {
+					nodes[task.node_index].left_first = task.begin;
+					nodes[task.node_index].primitive_count = n;
+					continue;
+				}
+
+				// Partition the other two axis lists so every list holds the same primitives on each side
+				for (int i = 0; i < n; i++) {
+					in_left[sorted[best_axis][task.begin + i]] = i < best_split;
+				}
+
+				for (int axis = 0; axis < 3; axis++) {
+					if (axis == best_axis) continue;
+
+					int* order = sorted[axis].data() + task.begin;
+					int left_count = 0;
+					int right_count = best_split;
+
+					for (int i = 0; i < n; i++) {
+						if (in_left[order[i]]) scratch[left_count++] = order[i];
+						else scratch[right_count++] = order[i];
+					}
+
+					std::copy(scratch.begin(), scratch.begin() + n, order);
+				}
+
+				int left_index = (int)nodes.size();
+				nodes.push_back(bvh_node());
+				nodes.push_back(bvh_node());
+
+				nodes[task.node_index].left_first = left_index;
+				nodes[task.node_index].primitive_count = 0;
+
+				tasks.push_back({ left_index + 1, task.begin + best_split, task.end, task.depth + 1 });
+				tasks.push_back({ left_index, task.begin, task.begin + best_split, task.depth + 1 });
+			}
+
+			primitive_indices = sorted[0];
+		}
+
+
+		/**
+		 * Primitive reference used by the binned builder. Bounds are kept next to the index so binning and
+		 * partitioning stream through memory instead of gathering from the input array.
+		*/
+		struct bvh_build_ref {
+			aabb bounds;
+			int index;
+
+			double centroid(int axis) const { return 0.5 * (bounds.minimum[axis] + bounds.maximum[axis]); }
+			point3 centroid() const { return bounds.centroid(); }
+		};
+
+		/**
+		 * Range of build references that still has to become a node.
+		*/
+		struct bvh_build_task {
+			int node_index;
+			int begin;
+			int end;
+			int depth;
+			aabb bounds;
+			aabb centroid_bounds;
+		};
+
+		struct bvh_bins {
+			aabb bounds[3][bvh_bin_count];
+			int count[3][bvh_bin_count] = {};
+
+			void merge(const bvh_bins& other, int bin_count) {
+				for (int axis = 0; axis < 3; axis++) {
+					for (int b = 0; b < bin_count; b++) {
+						bounds[axis][b].expand(other.bounds[axis][b]);
+						count[axis][b] += other.count[axis][b];
+					}
+				}
+			}
+		};
+
+		/**
+		 * Number of worker threads a parallel builder uses, following the thread_limit rule of the renderers.
+		*/
+		int bvh_thread_count(int thread_limit) {
+			int cores = (int)std::thread::hardware_concurrency();
+
+			if (thread_limit != -1 && thread_limit > 0) {
+				cores = std::min(cores, thread_limit);
+			}
+
+			return std::max(cores, 1);
+		}
+
+		/**
+		 * Run fn(slice, begin, end) over [0, count) split into equal slices, spread over the shared thread pool.
+		*/
+		template <typename F>
+		void bvh_parallel_slices(int count, int slices, F fn) {
+			thread_pool::global().parallel_for(slices, [&](int s) {
+				int begin = (int)((long long)count * s / slices);
+				int end = (int)((long long)count * (s + 1) / slices);
+				fn(s, begin, end);
+			}, slices);
+		}
+
+		/**
+		 * Maps centroids into bins along each axis. An axis with no centroid extent gets a scale of zero and is not binned.
+		 * Small ranges use fewer bins, most nodes are near the leaves and the per node cost would dominate otherwise.
+		*/
+		struct bvh_bin_mapping {
+			int bin_count;
+			double axis_min[3];
+			double scale[3];
+
+			bvh_bin_mapping(const aabb& centroid_bounds, int primitive_count) {
+				bin_count = std::min(bvh_bin_count, std::max(4, primitive_count));
+
+				for (int axis = 0; axis < 3; axis++) {
+					double extent = centroid_bounds.maximum[axis] - centroid_bounds.minimum[axis];
+					axis_min[axis] = centroid_bounds.minimum[axis];
+					scale[axis] = extent > 0 ? bin_count / extent : 0;
+				}
+			}
+
+			int bin(const bvh_build_ref& ref, int axis) const {
+				return std::min(bin_count - 1, (int)((ref.centroid(axis) - axis_min[axis]) * scale[axis]));
+			}
+		};
+
+		void bvh_bin_refs(const bvh_build_ref* refs, int count, const bvh_bin_mapping& mapping, bvh_bins& bins) {
+			for (int i = 0; i < count; i++) {
+				for (int axis = 0; axis < 3; axis++) {
+					if (mapping.scale[axis] == 0) continue;
+
+					int b = mapping.bin(refs[i], axis);
+					bins.count[axis][b]++;
+					bins.bounds[axis][b].expand(refs[i].bounds);
+				}
+			}
+		}
+
+		/**
+		 * Split one build task with the binned SAH, partitioning refs in place.
+		 * @param threads Number of threads to bin and partition with, only worth it for large ranges
+		 * @param scratch Partition buffer the size of refs, only used when threads > 1
+		 * @return false if the task should become a leaf
+		*/
+		bool bvh_binned_split(std::vector<bvh_build_ref>& refs, std::vector<bvh_build_ref>& scratch, const bvh_build_task& task, int threads, bvh_build_task& left, bvh_build_task& right) {
+			const int n = task.end - task.begin;
+
+			if (n == 1 || task.depth >= bvh_max_depth) return false;
+
+			const bvh_bin_mapping mapping(task.centroid_bounds, n);
+			const int bin_count = mapping.bin_count;
+			bvh_build_ref* range = refs.data() + task.begin;
+
+			bvh_bins bins;
+			if (threads > 1) {
+				std::vector<bvh_bins> slice_bins(threads);
+				bvh_parallel_slices(n, threads, [&](int slice, int begin, int end) {
+					bvh_bin_refs(range + begin, end - begin, mapping, slice_bins[slice]);
+				});
+				for (const auto& b : slice_bins) bins.merge(b, bin_count);
+			}
+			else {
+				bvh_bin_refs(range, n, mapping, bins);
+			}
+
+			// Sweep the bin boundaries of every axis
+			int best_axis = -1;
+			int best_bin = 0; // First bin of the right child
+			double best_cost = infinity;
+
+			for (int axis = 0; axis < 3; axis++) {
+				if (mapping.scale[axis] == 0) continue;
+
+				double right_area[bvh_bin_count];
+				int right_count[bvh_bin_count];
+
+				aabb right_bounds;
+				int right_sum = 0;
+				for (int b = bin_count - 1; b > 0; b--) {
+					right_bounds.expand(bins.bounds[axis][b]);
+					right_sum += bins.count[axis][b];
+					right_area[b] = right_bounds.surface_area();
+					right_count[b] = right_sum;
+				}
+
+				aabb left_bounds;
+				int left_sum = 0;
+				for (int b = 1; b < bin_count; b++) {
+					left_bounds.expand(bins.bounds[axis][b - 1]);
+					left_sum += bins.count[axis][b - 1];
+
+					if (left_sum == 0 || right_count[b] == 0) continue;
+
+					double cost = left_bounds.surface_area() * left_sum + right_area[b] * right_count[b];
+					if (cost < best_cost) {
+						best_cost = cost;
+						best_axis = axis;
+						best_bin = b;
+					}
+				}
+			}
+
+			left = { -1, task.begin, 0, task.depth + 1, aabb(), aabb() };
+			right = { -1, 0, task.end, task.depth + 1, aabb(), aabb() };
+
+			if (best_axis == -1) {
+				// Every centroid coincides, the SAH cannot separate them so just halve the range
+				if (n <= bvh_max_leaf_size) return false;
+
+				left.end = right.begin = task.begin + n / 2;
+				for (int i = left.begin; i < left.end; i++) left.bounds.expand(refs[i].bounds);
+				for (int i = right.begin; i < right.end; i++) right.bounds.expand(refs[i].bounds);
+				left.centroid_bounds = aabb(task.centroid_bounds.minimum, task.centroid_bounds.minimum);
+				right.centroid_bounds = left.centroid_bounds;
+				return true;
+			}
+
+			const double parent_area = task.bounds.surface_area();
+			best_cost = parent_area > 0 ? bvh_traversal_cost + bvh_intersection_cost * best_cost / parent_area : 0;
+
+			if (best_cost >= bvh_intersection_cost * n && n <= bvh_max_leaf_size) return false;
+
+			for (int b = 0; b < bin_count; b++) {
+				if (b < best_bin) left.bounds.expand(bins.bounds[best_axis][b]);
+				else right.bounds.expand(bins.bounds[best_axis][b]);
+			}
+
+			auto goes_left = [&](const bvh_build_ref& ref) { return mapping.bin(ref, best_axis) < best_bin; };
+
+			if (threads > 1) {
+				// Each slice counts its left refs, then scatters into the scratch buffer at its prefix offsets
+				std::vector<int> slice_left(threads);
+				std::vector<aabb> slice_left_centroids(threads), slice_right_centroids(threads);
+
+				bvh_parallel_slices(n, threads, [&](int slice, int begin, int end) {
+					int left_count = 0;
+					for (int i = begin; i < end; i++) {
+						if (goes_left(range[i])) left_count++;
+					}
+					slice_left[slice] = left_count;
+				});
+
+				int total_left = 0;
+				std::vector<int> left_offset(threads), right_offset(threads);
+				for (int s = 0; s < threads; s++) {
+					left_offset[s] = total_left;
+					total_left += slice_left[s];
+				}
+				for (int s = 0, right_sum = total_left; s < threads; s++) {
+					right_offset[s] = right_sum;
+					right_sum += (int)((long long)n * (s + 1) / threads) - (int)((long long)n * s / threads) - slice_left[s];
+				}
+
+				bvh_build_ref* out = scratch.data() + task.begin;
+				bvh_parallel_slices(n, threads, [&](int slice, int begin, int end) {
+					int l = left_offset[slice];
+					int r = right_offset[slice];
+					for (int i = begin; i < end; i++) {
+						if (goes_left(range[i])) {
+							slice_left_centroids[slice].expand(range[i].centroid());
+							out[l++] = range[i];
+						}
+						else {
+							slice_right_centroids[slice].expand(range[i].centroid());
+							out[r++] = range[i];
+						}
+					}
+				});
+
+				bvh_parallel_slices(n, threads, [&](int /*slice*/, int begin, int end) {
+					std::copy(out + begin, out + end, range + begin);
+				});
+
+				for (int s = 0; s < threads; s++) {
+					left.centroid_bounds.expand(slice_left_centroids[s]);
+					right.centroid_bounds.expand(slice_right_centroids[s]);
+				}
+
+				left.end = right.begin = task.begin + total_left;
+				return true;
+			}
+
+			int i = 0;
+			int j = n - 1;
+			while (true) {
+				while (i <= j && goes_left(range[i])) {
+					left.centroid_bounds.expand(range[i].centroid());
+					i++;
+				}
+				while (i <= j && !goes_left(range[j])) {
+					right.centroid_bounds.expand(range[j].centroid());
+					j--;
+				}
+				if (i > j) break;
+				std::swap(range[i], range[j]);
+			}
+
+			left.end = right.begin = task.begin + i;
+			return true;
+		}
+
+		/**
+		 * Serially build a binned SAH subtree. The subtree root is node 0 of nodes.
+		*/
+		void bvh_binned_build_subtree(std::vector<bvh_build_ref>& refs, const bvh_build_task& root, std::vector<bvh_node>& nodes) {
+			std::vector<bvh_build_ref> no_scratch;
+
+			nodes.clear();
+			nodes.reserve(2 * (root.end - root.begin));
+			nodes.push_back(bvh_node());
+
+			std::vector<bvh_build_task> tasks;
+			tasks.push_back(root);
+			tasks.back().node_index = 0;
+
+			bvh_build_task left, right;
+
+			while (!tasks.empty()) {
+				bvh_build_task task = tasks.back();
+				tasks.pop_back();
+
+				bvh_node& node = nodes[task.node_index];
+				node.bounds = task.bounds;
+
+				if (!bvh_binned_split(refs, no_scratch, task, 1, left, right)) {
+					node.left_first = task.begin;
+					node.primitive_count = task.end - task.begin;
+					continue;
+				}
+
+				int left_index = (int)nodes.size();
+				node.left_first = left_index;
+				node.primitive_count = 0;
+
+				nodes.push_back(bvh_node());
+				nodes.push_back(bvh_node());
+
+				left.node_index = left_index;
+				right.node_index = left_index + 1;
+				tasks.push_back(right);
+				tasks.push_back(left);
+			}
+		}
+
+		/**
+		 * Build a BVH over a set of primitive bounds with a binned surface area heuristic.
+		 * The top of the tree is split one node at a time with binning and partitioning spread over the worker threads,
+		 * until there are enough independent subtrees, which are then built in parallel and stitched into one node list.
+		 * @param primitive_bounds Bounds of each primitive
+		 * @param nodes Output nodes, the root is node 0
+		 * @param primitive_indices Output primitive order, leaves reference ranges of this list
+		 * @param thread_limit Maximum number of worker threads, -1 for no limit
+		*/
+		void build_bvh_binned(const std::vector<aabb>& primitive_bounds, std::vector<bvh_node>& nodes, std::vector<int>& primitive_indices, int thread_limit = -1) {
+			const int count = (int)primitive_bounds.size();
+
+			nodes.clear();
+			primitive_indices.clear();
+
+			if (count == 0) return;
+
+			const int cores = bvh_thread_count(thread_limit);
+
+			// Ranges smaller than this are binned and partitioned on one thread
+			const int min_parallel_split = 1 << 16;
+			// Small subtrees are not worth handing to another thread
+			const int min_subtree_size = 1024;
+			const int target_subtrees = cores * 4;
+
+			std::vector<bvh_build_ref> refs(count);
+			std::vector<bvh_build_ref> scratch;
+			if (cores > 1 && count >= min_parallel_split) scratch.resize(count);
+
+			bvh_build_task root = { 0, 0, count, 0, aabb(), aabb() };
+			{
+				const int slices = count >= min_parallel_split ? cores : 1;
+				std::vector<aabb> slice_bounds(slices), slice_centroids(slices);
+
+				bvh_parallel_slices(count, slices, [&](int slice, int begin, int end) {
+					for (int i = begin; i < end; i++) {
+						refs[i].bounds = primitive_bounds[i];
+						refs[i].index = i;
+						slice_bounds[slice].expand(refs[i].bounds);
+						slice_centroids[slice].expand(refs[i].centroid());
+					}
+				});
+
+				for (int s = 0; s < slices; s++) {
+					root.bounds.expand(slice_bounds[s]);
+					root.centroid_bounds.expand(slice_centroids[s]);
+				}
+			}
+
+			nodes.reserve(2 * count);
+			nodes.push_back(bvh_node());
+
+			std::vector<bvh_build_task> pending;
+			pending.push_back(root);
+
+			bvh_build_task left, right;
+
+			// Split the largest pending range until there is enough work to go around
+			while (!pending.empty() && (int)pending.size() < target_subtrees) {
+				auto largest = std::max_element(pending.begin(), pending.end(), [](const bvh_build_task& a, const bvh_build_task& b) {
+					return (a.end - a.begin) < (b.end - b.begin);
+				});
+
+				const int n = largest->end - largest->begin;
+				if (n < min_subtree_size) break;
+
+				bvh_build_task task = *largest;
+				pending.erase(largest);
+
+				bvh_node& node = nodes[task.node_index];
+				node.bounds = task.bounds;
+
+				int threads = (cores > 1 && n >= min_parallel_split) ? cores : 1;
+
+				if (!bvh_binned_split(refs, scratch, task, threads, left, right)) {
+					node.left_first = task.begin;
+					node.primitive_count = n;
+					continue;
+				}
+
+				int left_index = (int)nodes.size();
+				node.left_first = left_index;
+				node.primitive_count = 0;
+
+				nodes.push_back(bvh_node());
+				nodes.push_back(bvh_node());
+
+				left.node_index = left_index;
+				right.node_index = left_index + 1;
+				pending.push_back(left);
+				pending.push_back(right);
+			}
+
+			// Largest subtrees first so the last thread to finish is not stuck with a big one
+			std::sort(pending.begin(), pending.end(), [](const bvh_build_task& a, const bvh_build_task& b) {
+				return (a.end - a.begin) > (b.end - b.begin);
+			});
+
+			const int subtree_count = (int)pending.size();
+			std::vector<std::vector<bvh_node>> subtrees(subtree_count);
+
+			thread_pool::global().parallel_for(subtree_count, [&](int i) {
+				bvh_binned_build_subtree(refs, pending[i], subtrees[i]);
+			}, cores);
+
+			// Stitch subtrees in, their root replaces the placeholder and the rest is appended
+			for (int i = 0; i < subtree_count; i++) {
+				const std::vector<bvh_node>& subtree = subtrees[i];
+				const int base = (int)nodes.size() - 1; // Local node j > 0 lands at base + j
+
+				for (int j = 0; j < (int)subtree.size(); j++) {
+					bvh_node node = subtree[j];
+					if (!node.is_leaf()) node.left_first += base;
+
+					if (j == 0) nodes[pending[i].node_index] = node;
+					else nodes.push_back(node);
+				}
+			}
+
+			primitive_indices.resize(count);
+			for (int i = 0; i < count; i++) {
+				primitive_indices[i] = refs[i].index;
+			}
+		}
+
+		/**
+		 * Spread the low 21 bits of v so there are two zero bits between each of them.
+		*/
+		inline uint64_t morton_expand_bits(uint64_t v) {
+			v &= 0x1fffff;
+			v = (v | v << 32) & 0x1f00000000ffffULL;
+			v = (v | v << 16) & 0x1f0000ff0000ffULL;
+			v = (v | v << 8) & 0x100f00f00f00f00fULL;
+			v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+			v = (v | v << 2) & 0x1249249249249249ULL;
+			return v;
+		}
+
+		/**
+		 * Morton code of a point in the unit cube.
+		 * @param bits_per_axis 10 for 30 bit codes, 21 for 63 bit codes
+		*/
+		inline uint64_t morton_code(double x, double y, double z, int bits_per_axis) {
+			const double scale = (double)(1ULL << bits_per_axis);
+			const double max_cell = scale - 1;
+
+			uint64_t ix = (uint64_t)std::min(std::max(x * scale, 0.0), max_cell);
+			uint64_t iy = (uint64_t)std::min(std::max(y * scale, 0.0), max_cell);
+			uint64_t iz = (uint64_t)std::min(std::max(z * scale, 0.0), max_cell);
+
+			return (morton_expand_bits(ix) << 2) | (morton_expand_bits(iy) << 1) | morton_expand_bits(iz);
+		}
+
+		/**
+		 * Parallel LSD radix sort of 64 bit keys with a payload, 8 bits per pass.
+		 * @param key_bits Only the low key_bits of each key are sorted on
+		*/
+		void radix_sort_parallel(std::vector<uint64_t>& keys, std::vector<int>& values, int key_bits, int threads) {
+			const int count = (int)keys.size();
+			const int radix = 256;
+
+			std::vector<uint64_t> keys_out(count);
+			std::vector<int> values_out(count);
+			std::vector<int> histograms((size_t)threads * radix);
+
+			for (int shift = 0; shift < key_bits; shift += 8) {
+				std::fill(histograms.begin(), histograms.end(), 0);
+
+				bvh_parallel_slices(count, threads, [&](int slice, int begin, int end) {
+					int* histogram = histograms.data() + (size_t)slice * radix;
+					for (int i = begin; i < end; i++) {
+						histogram[(keys[i] >> shift) & 0xff]++;
+					}
+				});
+
+				// Digit major, slice minor prefix sum gives every slice its own output offset per digit
+				int offset = 0;
+				for (int digit = 0; digit < radix; digit++) {
+					for (int slice = 0; slice < threads; slice++) {
+						int digit_count = histograms[(size_t)slice * radix + digit];
+						histograms[(size_t)slice * radix + digit] = offset;
+						offset += digit_count;
+					}
+				}
+
+				bvh_parallel_slices(count, threads, [&](int slice, int begin, int end) {
+					int* offsets = histograms.data() + (size_t)slice * radix;
+					for (int i = begin; i < end; i++) {
+						int destination = offsets[(keys[i] >> shift) & 0xff]++;
+						keys_out[destination] = keys[i];
+						values_out[destination] = values[i];
+					}
+				});
+
+				keys.swap(keys_out);
+				values.swap(values_out);
+			}
+		}
+
+		/**
+		 * Build a linear BVH (Karras 2012). Primitive centroids are sorted along a Morton curve with a parallel radix sort,
+		 * every internal node of the resulting radix tree is found independently in parallel, then the tree is laid out
+		 * in the bvh_node format and bounds are computed bottom up. Everything is O(n), which makes it cheap enough to
+		 * rebuild every frame, at the cost of lower tree quality than the SAH builders.
+		 * @param primitive_bounds Bounds of each primitive
+		 * @param nodes Output nodes, the root is node 0
+		 * @param primitive_indices Output primitive order, leaves reference ranges of this list
+		 * @param thread_limit Maximum number of worker threads, -1 for no limit
+		 * @param morton_bits_per_axis 10 for 30 bit codes, 21 for 63 bit codes
+		*/
+		void build_bvh_lbvh(const std::vector<aabb>& primitive_bounds, std::vector<bvh_node>& nodes, std::vector<int>& primitive_indices, int thread_limit = -1, int morton_bits_per_axis = 21) {
+			const int count = (int)primitive_bounds.size();
+
+			nodes.clear();
+			primitive_indices.clear();
+
+			if (count == 0) return;
+
+			if (count == 1) {
+				nodes.push_back({ primitive_bounds[0], 0, 1 });
+				primitive_indices.push_back(0);
+				return;
+			}
+
+			// Small scenes are not worth the thread start up
+			const int threads = count >= (1 << 14) ? bvh_thread_count(thread_limit) : 1;
+
+			std::vector<aabb> slice_centroids(threads);
+			bvh_parallel_slices(count, threads, [&](int slice, int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					slice_centroids[slice].expand(primitive_bounds[i].centroid());
+				}
+			});
+
+			aabb centroid_bounds;
+			for (const aabb& box : slice_centroids) centroid_bounds.expand(box);
+
+			vec3 extent = centroid_bounds.maximum - centroid_bounds.minimum;
+			vec3 inv_extent(extent.x() > 0 ? 1.0 / extent.x() : 0, extent.y() > 0 ? 1.0 / extent.y() : 0, extent.z() > 0 ? 1.0 / extent.z() : 0);
+
+			std::vector<uint64_t> codes(count);
+			primitive_indices.resize(count);
+
+			bvh_parallel_slices(count, threads, [&](int /*slice*/, int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					vec3 p = (primitive_bounds[i].centroid() - centroid_bounds.minimum) * inv_extent;
+					codes[i] = morton_code(p.x(), p.y(), p.z(), morton_bits_per_axis);
+					primitive_indices[i] = i;
+				}
+			});
+
+			radix_sort_parallel(codes, primitive_indices, 3 * morton_bits_per_axis, threads);
+
+			// Length of the common prefix of two sorted keys, duplicates are told apart by their position
+			auto delta = [&](int i, int j) -> int {
+				if (j < 0 || j >= count) return -1;
+				if (codes[i] == codes[j]) return 64 + std::countl_zero((uint32_t)(i ^ j));
+				return std::countl_zero(codes[i] ^ codes[j]);
+			};
+
+			// Radix tree: internal nodes are 0..count-2, a child index >= count - 1 is leaf (index - (count - 1))
+			const int internal_count = count - 1;
+			std::vector<int> left_child(internal_count), right_child(internal_count);
+
+			bvh_parallel_slices(internal_count, threads, [&](int /*slice*/, int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					// Direction of the range covered by this node
+					const int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+					const int delta_min = delta(i, i - d);
+
+					// Upper bound of the range length, then binary search for the other end
+					int length_max = 2;
+					while (delta(i, i + length_max * d) > delta_min) length_max *= 2;
+
+					int length = 0;
+					for (int t = length_max / 2; t >= 1; t /= 2) {
+						if (delta(i, i + (length + t) * d) > delta_min) length += t;
+					}
+					const int j = i + length * d;
+
+					// Binary search for the split position
+					const int delta_node = delta(i, j);
+					int split = 0;
+					int t = length;
+					do {
+						t = (t + 1) / 2;
+						if (delta(i, i + (split + t) * d) > delta_node) split += t;
+					} while (t > 1);
+
+					const int gamma = i + split * d + std::min(d, 0);
+
+					left_child[i] = std::min(i, j) == gamma ? internal_count + gamma : gamma;
+					right_child[i] = std::max(i, j) == gamma + 1 ? internal_count + gamma + 1 : gamma + 1;
+				}
+			});
+
+			// Lay the tree out with siblings next to each other. Children always land after their parent,
+			// so walking the nodes backwards afterwards visits children before parents.
+			nodes.resize(2 * (size_t)count - 1);
+			nodes[0].primitive_count = 0;
+
+			struct layout_task {
+				int radix_index;
+				int node_index;
+			};
+
+			std::vector<layout_task> tasks;
+			tasks.push_back({ 0, 0 });
+			int next_node = 1;
+
+			while (!tasks.empty()) {
+				layout_task task = tasks.back();
+				tasks.pop_back();
+
+				bvh_node& node = nodes[task.node_index];
+
+				if (task.radix_index >= internal_count) {
+					node.left_first = task.radix_index - internal_count;
+					node.primitive_count = 1;
+					continue;
+				}
+
+				node.left_first = next_node;
+				node.primitive_count = 0;
+				next_node += 2;
+
+				tasks.push_back({ right_child[task.radix_index], node.left_first + 1 });
+				tasks.push_back({ left_child[task.radix_index], node.left_first });
+			}
+
+			for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+				bvh_node& node = nodes[i];
+
+				if (node.is_leaf()) {
+					node.bounds = primitive_bounds[primitive_indices[node.left_first]];
+				}
+				else {
+					node.bounds = surrounding_box(nodes[node.left_first].bounds, nodes[node.left_first + 1].bounds);
+				}
+			}
+		}
+
+		/**
+		 * Turn every subtree with at least min_leaf_size and at most max_leaf_size primitives into one leaf, for leaf kernels
+		 * that test several primitives at once as cheaply as one. Smaller subtrees are kept as built, their leaves would be
+		 * tested one primitive at a time anyway. Only subtrees whose primitives are contiguous in the primitive order are
+		 * merged, which they are for all builders here. The nodes are renumbered without the removed ones.
+		*/
+		void bvh_merge_small_subtrees(std::vector<bvh_node>& nodes, int min_leaf_size, int max_leaf_size) {
+			if (nodes.empty()) return;
+
+			struct subtree {
+				int first, end, count;
+				bool contiguous;
+			};
+
+			// Children always come after their parent, so a reverse sweep sees them first
+			std::vector<subtree> subtrees(nodes.size());
+			for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+				const bvh_node& node = nodes[i];
+				if (node.is_leaf()) {
+					subtrees[i] = { node.left_first, node.left_first + node.primitive_count, node.primitive_count, true };
+				}
+				else {
+					const subtree& left = subtrees[node.left_first];
+					const subtree& right = subtrees[node.left_first + 1];
+					int first = std::min(left.first, right.first);
+					int end = std::max(left.end, right.end);
+					int count = left.count + right.count;
+					subtrees[i] = { first, end, count, left.contiguous && right.contiguous && end - first == count };
+				}
+			}
+
+			struct copy_task {
+				int source;
+				int target;
+			};
+
+			std::vector<bvh_node> merged;
+			merged.reserve(nodes.size());
+			merged.push_back(nodes[0]);
+
+			std::vector<copy_task> tasks;
+			tasks.push_back({ 0, 0 });
+
+			while (!tasks.empty()) {
+				copy_task task = tasks.back();
+				tasks.pop_back();
+
+				const bvh_node& source = nodes[task.source];
+				const subtree& tree = subtrees[task.source];
+
+				if (source.is_leaf()) continue;
+
+				if (tree.contiguous && tree.count >= min_leaf_size && tree.count <= max_leaf_size) {
+					merged[task.target].left_first = tree.first;
+					merged[task.target].primitive_count = tree.count;
+					continue;
+				}
+
+				int left = (int)merged.size();
+				merged[task.target].left_first = left;
+				merged.push_back(nodes[source.left_first]);
+				merged.push_back(nodes[source.left_first + 1]);
+
+				tasks.push_back({ source.left_first + 1, left + 1 });
+				tasks.push_back({ source.left_first, left });
+			}
+
+			nodes.swap(merged);
+		}
+
+		/**
+		 * Expected cost of tracing a ray through the tree under the surface area heuristic, relative to the root.
+		 * Used to tell how far a refitted tree has drifted from a fresh build.
+		*/
+		double bvh_sah_cost(const std::vector<bvh_node>& nodes) {
+			if (nodes.empty()) return 0;
+
+			const double root_area = nodes[0].bounds.surface_area();
+			if (root_area <= 0) return 0;
+
+			double cost = 0;
+			for (const bvh_node& node : nodes) {
+				double area = node.bounds.surface_area();
+				cost += node.is_leaf() ? area * node.primitive_count * bvh_intersection_cost : area * bvh_traversal_cost;
+			}
+
+			return cost / root_area;
+		}
+
+		/**
+		 * Find the parent of every node (-1 for the root) and list the leaves, the inputs of refit_bvh_parallel.
+		*/
+		void bvh_parents_and_leaves(const std::vector<bvh_node>& nodes, std::vector<int>& parents, std::vector<int>& leaves) {
+			parents.assign(nodes.size(), -1);
+			leaves.clear();
+
+			for (int i = 0; i < (int)nodes.size(); i++) {
+				if (nodes[i].is_leaf()) {
+					leaves.push_back(i);
+				}
+				else {
+					parents[nodes[i].left_first] = i;
+					parents[nodes[i].left_first + 1] = i;
+				}
+			}
+		}
+
+		/**
+		 * Recompute node bounds bottom up with the topology kept. Leaves are split over the threads and each thread walks
+		 * up from its leaves. Only the second child to arrive at a parent continues, so every interior node is written
+		 * once, after both of its children.
+		 * @param leaf_bounds fn(const bvh_node& leaf) returning the current bounds of the leaf's primitives
+		*/
+		template <typename F>
+		void refit_bvh_parallel(std::vector<bvh_node>& nodes, const std::vector<int>& parents, const std::vector<int>& leaves, int threads, F leaf_bounds) {
+			std::vector<std::atomic<int>> arrivals(nodes.size());
+
+			bvh_parallel_slices((int)leaves.size(), threads, [&](int /*slice*/, int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					int index = leaves[i];
+					nodes[index].bounds = leaf_bounds(nodes[index]);
+
+					int parent = parents[index];
+					while (parent != -1) {
+						// acq_rel makes the sibling's bounds visible to whoever arrives second
+						if (arrivals[parent].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+
+						bvh_node& node = nodes[parent];
+						node.bounds = surrounding_box(nodes[node.left_first].bounds, nodes[node.left_first + 1].bounds);
+						parent = parents[parent];
+					}
+				}
+			});
+		}
+
+	}
+}
+
+#endif // !BVH_BUILDER_H
@@ -46,7 +46,14 @@ namespace RAYTRACING {
 			}
 
 			ray get_ray(double s, double t) const {
-				vec3 rd = lens_radius * random_in_unit_disk();
+				return get_ray(s, t, thread_sampler());
+			}
+
+			/**
+			 * @param rng Generator for the lens sample
+			*/
+			ray get_ray(double s, double t, sampler& rng) const {
+				vec3 rd = lens_radius * random_in_unit_disk(rng);
 				vec3 offset = u * rd.x() + v * rd.y();
 
 				return ray(
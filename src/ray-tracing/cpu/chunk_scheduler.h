@@ -0,0 +1,117 @@
+#pragma once
+
+#ifndef CHUNK_SCHEDULER_H
+#define CHUNK_SCHEDULER_H
+
+#include "rt_cpu.h"
+
+#include <vector>
+#include <queue>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Plans progressive render passes by expected payoff instead of giving every active chunk one sample.
+		 * Chunks sit in a priority queue keyed by the error one more sample is expected to remove per millisecond it costs,
+		 * taken from the noise and sample_ms the render workers leave in the chunk headers. The best chunk gets a sample and
+		 * goes back in with its next, smaller gain, until the pass is full. Noisy chunks therefore get several samples per pass
+		 * while nearly converged ones wait.
+		*/
+		class chunk_scheduler {
+		public:
+			/**
+			 * @param data Chunk headers after the last pass
+			 * @param render_chunk Chunks that still need samples
+			 * @param threads Threads rendering the pass, turns the time budget into total work
+			 * @return Work for the next pass, the most expensive chunks first so the pass does not end on a long straggler
+			*/
+			std::vector<chunk_work> plan(const PixelChunkData_t* data, const bool* render_chunk, int size, int threads, const adaptive_settings& adaptive) const {
+				std::vector<chunk_work> work;
+
+				// Chunks that were not timed yet are assumed to cost as much as the average of the others
+				double known_ms = 0;
+				int known = 0;
+				int active = 0;
+				for (int i = 0; i < size; i++) {
+					if (!render_chunk[i]) continue;
+					active++;
+					if (data[i].sample_ms > 0) {
+						known_ms += data[i].sample_ms;
+						known++;
+					}
+				}
+				if (active == 0) return work;
+
+				const double default_ms = known > 0 ? known_ms / known : 1.0;
+				auto cost = [&](int i) { return data[i].sample_ms > 0 ? (double)data[i].sample_ms : default_ms; };
+
+				// Without a budget or timings a pass does as much work as the old one sample per active chunk
+				const bool timed = pass_budget_ms > 0 && known > 0;
+				const double capacity = timed ? pass_budget_ms * std::max(1, threads) : (double)active;
+
+				std::vector<int> assigned(size, 0);
+				std::priority_queue<std::pair<double, int>> queue;
+				for (int i = 0; i < size; i++) {
+					if (render_chunk[i]) queue.push({ priority(data[i], 0, cost(i), adaptive), i });
+				}
+
+				double used = 0;
+				while (!queue.empty()) {
+					int i = queue.top().second;
+					queue.pop();
+
+					double step = timed ? cost(i) : 1.0;
+					if (used > 0 && used + step > capacity) break;
+
+					used += step;
+					assigned[i]++;
+
+					if (assigned[i] < max_samples_per_pass && data[i].number_of_samples + assigned[i] < adaptive.max_samples) {
+						queue.push({ priority(data[i], assigned[i], cost(i), adaptive), i });
+					}
+				}
+
+				for (int i = 0; i < size; i++) {
+					if (assigned[i] > 0) work.push_back({ i, assigned[i] });
+				}
+				std::sort(work.begin(), work.end(), [&](const chunk_work& a, const chunk_work& b) {
+					return a.samples * cost(a.chunk) > b.samples * cost(b.chunk);
+				});
+
+				return work;
+			}
+
+		public:
+			// Wall clock time a pass should take, 0 keeps the work of a pass at one sample per active chunk
+			double pass_budget_ms = 0;
+			// Most samples one chunk gets in a pass, bounds how stale the other chunks' estimates get
+			int max_samples_per_pass = 8;
+
+		private:
+			/**
+			 * Error the next sample removes per millisecond, given extra samples already planned this pass.
+			 * The chunk's error is taken to fall with the square root of its sample count.
+			*/
+			static double priority(const PixelChunkData_t& chunk, int extra, double cost_ms, const adaptive_settings& adaptive) {
+				int n = chunk.number_of_samples + extra;
+
+				// Without a usable estimate yet, round robin with the fewest samples first, ahead of every estimated chunk
+				if (n < adaptive.min_samples || !std::isfinite(chunk.noise)) {
+					return 1e30 / (1.0 + n);
+				}
+
+				double error = chunk.noise * chunk.active_pixels * std::sqrt((double)chunk.number_of_samples / n);
+				double gain = error * (1.0 - std::sqrt((double)n / (n + 1)));
+				return gain / std::max(cost_ms, 1e-6);
+			}
+		};
+
+	}
+}
+
+#endif // !CHUNK_SCHEDULER_H
@@ -31,6 +31,13 @@ namespace RAYTRACING {
 				<< static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
 		}
 
+		/**
+		 * Rec. 709 luminance of a linear color.
+		*/
+		inline double luminance(const color& c) {
+			return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+		}
+
 		color correct_color_and_gamma(color& pixel_color, double samples_per_pixel) {
 			double r = pixel_color.x() / samples_per_pixel;
 			double g = pixel_color.y() / samples_per_pixel;
@@ -0,0 +1,379 @@
+#pragma once
+
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "rtweekend.h"
+#include "arena.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "primitive.h"
+#include "sphere_soup.h"
+#include "material.h"
+#include "simd.h"
+#include "bvh.h"
+#include "bvh4.h"
+
+#include "../../utility/tracelog.hpp"
+
+#include <vector>
+#include <tuple>
+#include <variant>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Flat copy of a hittable_list for rendering, specialized at compile time on a closed set of primitive types.
+		 * Objects of the listed types are copied into one contiguous array owned by an arena, in bvh leaf order, and
+		 * intersected through primitive_traits without virtual calls, so the hot path does no reference counting, walks memory
+		 * mostly linearly and has the primitive tests inlined. Their materials are copied once each and also packed into
+		 * a table of tagged parameter blocks that hits point to, see scatter_hit.
+		 * Objects of other types (instances, prebuilt bvhs, ...) are kept by reference and go into a separate bvh, through the
+		 * virtual hittable interface. The scene has to be compiled again when the source list changes.
+		 * A scene of only spheres also keeps them as a sphere soup: small subtrees are merged into leaves of up to
+		 * sphere_soup_width spheres, which the soup kernels test together.
+		 * @tparam Primitives Hittable types with a primitive_traits specialization, a single type is stored without a variant
+		*/
+		template<typename... Primitives>
+		class basic_compiled_scene : public hittable {
+			static_assert(sizeof...(Primitives) > 0, "a compiled scene needs at least one primitive type");
+
+		public:
+			using stored_primitive = std::conditional_t<sizeof...(Primitives) == 1,
+				typename primitive_traits<std::tuple_element_t<0, std::tuple<Primitives...>>>::compiled,
+				std::variant<typename primitive_traits<Primitives>::compiled...>>;
+
+			// Leaves are intersected with hit_sphere_soup
+			static constexpr bool sphere_soup_leaves = std::is_same_v<stored_primitive, compiled_sphere>;
+
+			basic_compiled_scene() {}
+			/**
+			 * @param list Objects to compile, nested lists are flattened
+			 * @param method Builder for the primitive bvh
+			 * @param thread_limit Maximum number of threads used by parallel builders, -1 for no limit
+			*/
+			basic_compiled_scene(const hittable_list& list, bvh_build_method method = bvh_build_method::binned_sah, int thread_limit = -1) {
+				compile(list, method, thread_limit);
+			}
+			basic_compiled_scene(const basic_compiled_scene&) = delete;
+			basic_compiled_scene& operator=(const basic_compiled_scene&) = delete;
+
+			void compile(const hittable_list& list, bvh_build_method method = bvh_build_method::binned_sah, int thread_limit = -1);
+
+			const material* material_at(uint32_t index) const { return materials[index]; }
+			const packed_material& packed_material_at(uint32_t index) const { return packed_materials[index]; }
+
+			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			virtual void hit_packet(const ray* rays, int count, double t_min, double t_max, hit_record* recs, bool* hits) const override;
+			virtual bool bounding_box(aabb& output_box) const override;
+
+		private:
+			// Object of one of the primitive types, type is its position in Primitives
+			struct source_primitive {
+				int type;
+				const hittable* object;
+			};
+
+			void gather(const hittable_list& list, std::vector<source_primitive>& sources);
+
+			/**
+			 * Run f with the source object cast to its primitive type, f(object, traits).
+			*/
+			template<size_t I = 0, typename F>
+			static auto visit_source(const source_primitive& source, F&& f) {
+				using P = std::tuple_element_t<I, std::tuple<Primitives...>>;
+				if constexpr (I + 1 < sizeof...(Primitives)) {
+					if (source.type != (int)I) return visit_source<I + 1>(source, f);
+				}
+				return f(static_cast<const P&>(*source.object), primitive_traits<P>());
+			}
+
+			static stored_primitive store(const source_primitive& source, uint32_t material) {
+				return visit_source(source, [&](const auto& object, auto traits) { return stored_primitive(traits.compile(object, material)); });
+			}
+
+			template<size_t I = 0>
+			static RT_FORCE_INLINE bool intersect_stored(const stored_primitive& p, const primitive_ray& pr, double t_min, double& closest) {
+				if constexpr (sizeof...(Primitives) == 1) {
+					using P = std::tuple_element_t<0, std::tuple<Primitives...>>;
+					return primitive_traits<P>::intersect(p, pr, t_min, closest);
+				}
+				else {
+					using P = std::tuple_element_t<I, std::tuple<Primitives...>>;
+					if (p.index() == I || I + 1 == sizeof...(Primitives)) {
+						return primitive_traits<P>::intersect(*std::get_if<I>(&p), pr, t_min, closest);
+					}
+					if constexpr (I + 1 < sizeof...(Primitives)) {
+						return intersect_stored<I + 1>(p, pr, t_min, closest);
+					}
+					return false;
+				}
+			}
+
+			/**
+			 * Fill in the surface of a hit at distance t.
+			 * @return Material index of the primitive
+			*/
+			template<size_t I = 0>
+			static uint32_t surface_stored(const stored_primitive& p, const primitive_ray& pr, double t, hit_record& rec) {
+				if constexpr (sizeof...(Primitives) == 1) {
+					using P = std::tuple_element_t<0, std::tuple<Primitives...>>;
+					primitive_traits<P>::surface(p, pr, t, rec);
+					return p.material;
+				}
+				else {
+					using P = std::tuple_element_t<I, std::tuple<Primitives...>>;
+					if (p.index() == I || I + 1 == sizeof...(Primitives)) {
+						const auto& compiled = *std::get_if<I>(&p);
+						primitive_traits<P>::surface(compiled, pr, t, rec);
+						return compiled.material;
+					}
+					if constexpr (I + 1 < sizeof...(Primitives)) {
+						return surface_stored<I + 1>(p, pr, t, rec);
+					}
+					return 0;
+				}
+			}
+
+			/**
+			 * Intersect the primitives of a bvh leaf, only the distance and the primitive of the closest hit are kept.
+			 * @param primitive Set to the index of the closest hit in primitives
+			*/
+			RT_FORCE_INLINE bool hit_leaf(int first, int count, const primitive_ray& pr, sphere_soup_ray& soup_ray, double t_min, double& closest, int& primitive) const {
+				if constexpr (sphere_soup_leaves) {
+					return hit_sphere_soup(soup, first, count, pr, soup_ray, t_min, closest, primitive);
+				}
+				else {
+					bool hit_any = false;
+					for (int i = first; i < first + count; i++) {
+						if (intersect_stored(primitives[i], pr, t_min, closest)) {
+							primitive = i;
+							hit_any = true;
+						}
+					}
+					return hit_any;
+				}
+			}
+
+			/**
+			 * Fill in the record of the closest hit once traversal is done, the only hit of the ray that needs its surface and material.
+			*/
+			void surface_hit(int primitive, const primitive_ray& pr, double t, hit_record& rec) const {
+				const uint32_t material = surface_stored(primitives[primitive], pr, t, rec);
+				rec.material_index = material;
+				rec.mat_ptr = materials[material];
+				rec.packed_mat = &packed_materials[material];
+			}
+
+		public:
+			arena storage;
+
+			// Arrays in storage
+			stored_primitive* primitives = nullptr; // In leaf order
+			int primitive_count = 0;
+			const material** materials = nullptr;
+			packed_material* packed_materials = nullptr; // Same order as materials
+			int material_count = 0;
+			bvh4_node* nodes = nullptr;
+			int node_count = 0;
+			sphere_soup_view soup; // Over primitives, only with sphere_soup_leaves
+
+			hittable_list external_objects;
+			bvh external_bvh;
+
+			aabb bounds;
+		};
+
+		/**
+		 * Compiled scene of the primitive types this renderer has.
+		*/
+		using compiled_scene = basic_compiled_scene<sphere>;
+
+		template<typename... Primitives>
+		void basic_compiled_scene<Primitives...>::gather(const hittable_list& list, std::vector<source_primitive>& sources) {
+			for (const auto& object : list.objects) {
+				// Position of the first primitive type the object is, -1 if none
+				int type = -1;
+				int index = 0;
+				auto check = [&](bool is_type) {
+					if (type < 0 && is_type) type = index;
+					index++;
+				};
+				(check(dynamic_cast<const Primitives*>(object.get()) != nullptr), ...);
+
+				if (type >= 0) {
+					sources.push_back({ type, object.get() });
+				}
+				else if (const hittable_list* nested = dynamic_cast<const hittable_list*>(object.get())) {
+					gather(*nested, sources);
+				}
+				else {
+					external_objects.add(object);
+				}
+			}
+		}
+
+		template<typename... Primitives>
+		void basic_compiled_scene<Primitives...>::compile(const hittable_list& list, bvh_build_method method, int thread_limit) {
+			auto start = std::chrono::steady_clock::now();
+
+			storage.clear();
+			external_objects.clear();
+			primitives = nullptr;
+			materials = nullptr;
+			packed_materials = nullptr;
+			nodes = nullptr;
+			soup = sphere_soup_view();
+			primitive_count = material_count = node_count = 0;
+			bounds = aabb();
+
+			std::vector<source_primitive> sources;
+			gather(list, sources);
+
+			// Materials shared by several primitives are copied once
+			std::unordered_map<const material*, uint32_t> material_indices;
+			std::vector<const material*> source_materials;
+			std::vector<uint32_t> primitive_materials(sources.size());
+
+			std::vector<aabb> primitive_bounds(sources.size());
+
+			for (size_t i = 0; i < sources.size(); i++) {
+				const material* m = visit_source(sources[i], [](const auto& object, auto traits) { return traits.material_of(object); });
+				auto found = material_indices.find(m);
+				if (found == material_indices.end()) {
+					found = material_indices.emplace(m, (uint32_t)source_materials.size()).first;
+					source_materials.push_back(m);
+				}
+				primitive_materials[i] = found->second;
+
+				aabb& box = primitive_bounds[i];
+				visit_source(sources[i], [&](const auto& object, auto traits) { return traits.bounds(object, box); });
+			}
+
+			material_count = (int)source_materials.size();
+			materials = storage.allocate_array<const material*>(material_count);
+			packed_materials = storage.allocate_array<packed_material>(material_count);
+			for (int i = 0; i < material_count; i++) {
+				materials[i] = source_materials[i]->copy_to(storage);
+				packed_materials[i] = source_materials[i]->pack();
+			}
+
+			std::vector<bvh_node> binary_nodes;
+			std::vector<int> order;
+
+			switch (method) {
+			case bvh_build_method::sah_sweep: build_bvh_sah(primitive_bounds, binary_nodes, order); break;
+			case bvh_build_method::binned_sah: build_bvh_binned(primitive_bounds, binary_nodes, order, thread_limit); break;
+			case bvh_build_method::lbvh: build_bvh_lbvh(primitive_bounds, binary_nodes, order, thread_limit); break;
+			}
+
+			if constexpr (sphere_soup_leaves) bvh_merge_small_subtrees(binary_nodes, sphere_soup_min_count, sphere_soup_width);
+
+			primitive_count = (int)order.size();
+			primitives = storage.allocate_array<stored_primitive>(primitive_count);
+			for (int i = 0; i < primitive_count; i++) {
+				new (&primitives[i]) stored_primitive(store(sources[order[i]], primitive_materials[order[i]]));
+			}
+
+			if constexpr (sphere_soup_leaves) {
+				const int padded = primitive_count + sphere_soup_padding;
+				float* center_x = storage.allocate_array<float>(padded);
+				float* center_y = storage.allocate_array<float>(padded);
+				float* center_z = storage.allocate_array<float>(padded);
+				float* radius = storage.allocate_array<float>(padded);
+				for (int i = 0; i < padded; i++) {
+					const bool used = i < primitive_count;
+					center_x[i] = used ? (float)primitives[i].center.x() : 0.0f;
+					center_y[i] = used ? (float)primitives[i].center.y() : 0.0f;
+					center_z[i] = used ? (float)primitives[i].center.z() : 0.0f;
+					radius[i] = used ? sphere_soup_radius(primitives[i]) : 0.0f;
+				}
+				soup = { center_x, center_y, center_z, radius, primitives };
+			}
+
+			std::vector<bvh4_node> wide_nodes;
+			bvh4_collapse(binary_nodes, wide_nodes);
+
+			node_count = (int)wide_nodes.size();
+			nodes = storage.allocate_array<bvh4_node>(node_count);
+			if (node_count > 0) std::memcpy(nodes, wide_nodes.data(), sizeof(bvh4_node) * node_count);
+
+			if (!binary_nodes.empty()) bounds = binary_nodes[0].bounds;
+
+			aabb external_bounds;
+			external_bvh.build(external_objects, method, thread_limit);
+			if (external_bvh.bounding_box(external_bounds)) bounds.expand(external_bounds);
+
+			double compile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			Tracelog::Debug("Scene compiled: %d primitives, %d materials, %d external objects, %d nodes in %.2f ms",
+				primitive_count, material_count, (int)external_objects.objects.size(), node_count, compile_ms);
+		}
+
+		template<typename... Primitives>
+		bool basic_compiled_scene<Primitives...>::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+			double closest_so_far = t_max;
+
+			const primitive_ray pr(r);
+			sphere_soup_ray soup_ray;
+			int primitive = 0;
+
+			bool hit_anything = bvh4_traverse(nodes, node_count, r, t_min, closest_so_far, [&](int first, int count, double& closest) {
+				return hit_leaf(first, count, pr, soup_ray, t_min, closest, primitive);
+			});
+
+			// External objects fill in the record themselves, a primitive only does when it stays the closest
+			if (external_bvh.hit(r, t_min, closest_so_far, rec)) {
+				rec.material_index = no_material_index;
+				rec.packed_mat = nullptr;
+				return true;
+			}
+
+			if (hit_anything) surface_hit(primitive, pr, closest_so_far, rec);
+			return hit_anything;
+		}
+
+		template<typename... Primitives>
+		void basic_compiled_scene<Primitives...>::hit_packet(const ray* rays, int count, double t_min, double t_max, hit_record* recs, bool* hits) const {
+			double closest_so_far[ray_packet_size];
+			sphere_soup_ray soup_rays[ray_packet_size];
+			int primitive[ray_packet_size];
+			for (int i = 0; i < count; i++) closest_so_far[i] = t_max;
+
+			bvh4_traverse_packet(nodes, node_count, rays, count, t_min, closest_so_far, hits, [&](int ray_index, int first, int primitives_in_leaf, double& closest) {
+				const primitive_ray pr(rays[ray_index]);
+				return hit_leaf(first, primitives_in_leaf, pr, soup_rays[ray_index], t_min, closest, primitive[ray_index]);
+			});
+
+			for (int i = 0; i < count; i++) {
+				if (external_bvh.hit(rays[i], t_min, closest_so_far[i], recs[i])) {
+					recs[i].material_index = no_material_index;
+					recs[i].packed_mat = nullptr;
+					hits[i] = true;
+				}
+				else if (hits[i]) {
+					surface_hit(primitive[i], primitive_ray(rays[i]), closest_so_far[i], recs[i]);
+				}
+			}
+		}
+
+		template<typename... Primitives>
+		bool basic_compiled_scene<Primitives...>::bounding_box(aabb& output_box) const {
+			if (bounds.empty()) return false;
+			output_box = bounds;
+			return true;
+		}
+
+	}
+}
+
+#endif // !COMPILED_SCENE_H
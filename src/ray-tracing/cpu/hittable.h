@@ -2,18 +2,32 @@
 #define HITTABLE_H
 
 #include "rtweekend.h"
+#include "aabb.h"
+
+#include <cstdint>
 
 namespace RAYTRACING {
 
 	namespace CPU {
 
 		class material;
+		struct packed_material;
+
+		// material_index of hits on objects that are not part of a compiled_scene
+		constexpr uint32_t no_material_index = 0xffffffffu;
 
+		// Camera rays are traced in packets of ray_packet_width x ray_packet_width pixels
+		constexpr int ray_packet_width = 4;
+		constexpr int ray_packet_size = ray_packet_width * ray_packet_width;
 
 		struct hit_record {
 			point3 p;
 			vec3 normal;
-			shared_ptr<material> mat_ptr;
+			const material* mat_ptr; // Not owning, the scene keeps its materials alive
+			// Set by compiled scenes, lets scatter_hit skip the virtual call. Hittables that set mat_ptr reset it along with
+			// material_index, records are reused across hits and scatter_hit trusts packed_mat over mat_ptr
+			const packed_material* packed_mat = nullptr;
+			uint32_t material_index = no_material_index;
 			double t;
 			bool front_face;
 
@@ -25,7 +39,25 @@ namespace RAYTRACING {
 
 		class hittable {
 		public:
+			/**
+			 * Closest hit of the ray in [t_min, t_max]. rec is only written when this returns true, so containers can pass
+			 * their caller's record down and have it hold the closest hit without copies.
+			*/
 			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+			/**
+			 * Closest hits of a packet of rays, meant for coherent rays such as the camera rays of a pixel tile.
+			 * The default traces the rays one by one, acceleration structures share their node tests between the rays.
+			 * @param count Rays in the packet, 0 to ray_packet_size
+			 * @param hits Set to whether each ray hit, recs is only written for the rays that did
+			*/
+			virtual void hit_packet(const ray* rays, int count, double t_min, double t_max, hit_record* recs, bool* hits) const {
+				for (int i = 0; i < count; i++) hits[i] = hit(rays[i], t_min, t_max, recs[i]);
+			}
+			/**
+			 * Bounds of the object, used to build acceleration structures.
+			 * @return false if the object has no bounds (e.g. an empty list)
+			*/
+			virtual bool bounding_box(aabb& output_box) const = 0;
 		};
 
 	}
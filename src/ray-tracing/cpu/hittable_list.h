@@ -23,26 +23,40 @@ namespace RAYTRACING {
 			void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
 			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			virtual bool bounding_box(aabb& output_box) const override;
 		public:
 			std::vector<shared_ptr<hittable>> objects;
 		};
 
 		bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-			hit_record temp_rec;
 			bool hit_anything = false;
 			auto closest_so_far = t_max;
 
+			// Objects only write to the record when they report a closer hit
 			for (const auto& object : objects) {
-				if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+				if (object->hit(r, t_min, closest_so_far, rec)) {
 					hit_anything = true;
-					closest_so_far = temp_rec.t;
-					rec = temp_rec;
+					closest_so_far = rec.t;
 				}
 			}
 
 			return hit_anything;
 		}
 
+		bool hittable_list::bounding_box(aabb& output_box) const {
+			if (objects.empty()) return false;
+
+			aabb temp_box;
+			output_box = aabb();
+
+			for (const auto& object : objects) {
+				if (!object->bounding_box(temp_box)) return false;
+				output_box.expand(temp_box);
+			}
+
+			return true;
+		}
+
 	}
 }
 
@@ -0,0 +1,74 @@
+#pragma once
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "transform.h"
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Placement of a shared object (usually a bvh over its geometry) in the world. Any number of instances can reference the same
+		 * object, so only the unique geometry is stored once and a top level bvh over the instances is built instead of one over every primitive.
+		*/
+		class instance : public hittable {
+		public:
+			instance() {}
+			/**
+			 * @param obj Shared bottom level object, in its own object space
+			 * @param object_to_world Placement of the object
+			 * @param material_override Material used for every hit on this instance, nullptr keeps the materials of the object
+			*/
+			instance(shared_ptr<hittable> obj, const transform& object_to_world, shared_ptr<material> material_override = nullptr)
+				: object(obj), to_world(object_to_world), to_object(object_to_world.inverse()), mat_override(material_override) {
+				aabb object_box;
+				has_bounds = object->bounding_box(object_box);
+				if (has_bounds) world_box = to_world.apply_box(object_box);
+			}
+
+			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			virtual bool bounding_box(aabb& output_box) const override;
+
+		public:
+			shared_ptr<hittable> object;
+			transform to_world;
+			transform to_object;
+			shared_ptr<material> mat_override;
+			aabb world_box;
+			bool has_bounds = false;
+		};
+
+		bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+			// The direction is not normalized, so distances along the object space ray match the world space ones
+			ray object_ray(to_object.apply_point(r.origin()), to_object.apply_vector(r.direction()));
+
+			if (!object->hit(object_ray, t_min, t_max, rec)) return false;
+
+			rec.p = r.at(rec.t);
+			// Normals go through the inverse transpose. The facing side does not change under an affine map, so front_face stays valid
+			rec.normal = unit_vector(to_object.apply_normal_transposed(rec.normal));
+			if (mat_override) {
+				// The packed material of a compiled object would otherwise win over the override in scatter_hit
+				rec.mat_ptr = mat_override.get();
+				rec.packed_mat = nullptr;
+				rec.material_index = no_material_index;
+			}
+
+			return true;
+		}
+
+		bool instance::bounding_box(aabb& output_box) const {
+			if (!has_bounds) return false;
+			output_box = world_box;
+			return true;
+		}
+
+	}
+}
+
+#endif // !INSTANCE_H
@@ -3,6 +3,9 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
+#include "arena.h"
+
+#include <cstdint>
 
 namespace RAYTRACING {
 
@@ -10,11 +13,102 @@ namespace RAYTRACING {
 
         struct hit_record;
 
+        /**
+         * Type tag of a packed_material, selects the scatter it runs.
+        */
+        enum class material_type : uint32_t {
+            lambertian,
+            metal,
+            dielectric,
+            virtual_call // Not one of the built in materials, scatters through the hit's mat_ptr
+        };
+
+        // Built in types, the ones with batch kernels
+        constexpr int packed_material_types = 3;
+
+        /**
+         * Closed form of a material: type tag and the parameters of every built in type in one flat block, so a table of
+         * them can be dispatched with a switch instead of a virtual call.
+        */
+        struct packed_material {
+            material_type type = material_type::virtual_call;
+            color albedo = color(1, 1, 1); // lambertian, metal
+            double fuzz = 0;               // metal
+            double ir = 1;                 // dielectric
+        };
+
+        /**
+         * Use Schlick's approximation for reflectance.
+        */
+        inline double schlick_reflectance(double cosine, double ref_idx) {
+            auto r0 = (1 - ref_idx) / (1 + ref_idx);
+            r0 = r0 * r0;
+            return r0 + (1 - r0) * pow((1 - cosine), 5);
+        }
+
+        inline bool scatter_lambertian(const color& albedo, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng) {
+            auto scatter_direction = rec.normal + random_unit_vector(rng);
+
+            // Catch degenerate scatter direction
+            if (scatter_direction.near_zero())
+                scatter_direction = rec.normal;
+
+            scattered = ray(rec.p, scatter_direction);
+            attenuation = albedo;
+            return true;
+        }
+
+        inline bool scatter_metal(const color& albedo, double fuzz, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng) {
+            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+            scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(rng));
+            attenuation = albedo;
+            return (dot(scattered.direction(), rec.normal) > 0);
+        }
+
+        inline bool scatter_dielectric(double ir, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng) {
+            attenuation = color(1.0, 1.0, 1.0);
+            double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+
+            vec3 unit_direction = unit_vector(r_in.direction());
+            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+            double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+
+            bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+            vec3 direction;
+
+            if (cannot_refract || schlick_reflectance(cos_theta, refraction_ratio) > rng.next_double())
+                direction = reflect(unit_direction, rec.normal);
+            else
+                direction = refract(unit_direction, rec.normal, refraction_ratio);
+
+            scattered = ray(rec.p, direction);
+            return true;
+        }
+
         class material {
         public:
-            virtual bool scatter(
+            bool scatter(
                 const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            ) const {
+                return scatter(r_in, rec, attenuation, scattered, thread_sampler());
+            }
+
+            /**
+             * @param rng Generator for the scatter direction, owned by the calling thread or path
+            */
+            virtual bool scatter(
+                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng
             ) const = 0;
+
+            /**
+             * Copy the material into an arena, used when a scene is compiled.
+            */
+            virtual material* copy_to(arena& scene_arena) const = 0;
+
+            /**
+             * Closed form of the material for compiled scenes. Materials without one keep the virtual scatter.
+            */
+            virtual packed_material pack() const { return packed_material(); }
         };
 
         class lambertian : public material {
@@ -22,17 +116,20 @@ namespace RAYTRACING {
             lambertian(const color& a) : albedo(a) {}
 
             virtual bool scatter(
-                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng
             ) const override {
-                auto scatter_direction = rec.normal + random_unit_vector();
+                return scatter_lambertian(albedo, rec, attenuation, scattered, rng);
+            }
 
-                // Catch degenerate scatter direction
-                if (scatter_direction.near_zero())
-                    scatter_direction = rec.normal;
+            virtual material* copy_to(arena& scene_arena) const override {
+                return scene_arena.create<lambertian>(*this);
+            }
 
-                scattered = ray(rec.p, scatter_direction);
-                attenuation = albedo;
-                return true;
+            virtual packed_material pack() const override {
+                packed_material packed;
+                packed.type = material_type::lambertian;
+                packed.albedo = albedo;
+                return packed;
             }
         public:
             color albedo;
@@ -43,12 +140,21 @@ namespace RAYTRACING {
             metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
             virtual bool scatter(
-                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng
             ) const override {
-                vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-                scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
-                attenuation = albedo;
-                return (dot(scattered.direction(), rec.normal) > 0);
+                return scatter_metal(albedo, fuzz, r_in, rec, attenuation, scattered, rng);
+            }
+
+            virtual material* copy_to(arena& scene_arena) const override {
+                return scene_arena.create<metal>(*this);
+            }
+
+            virtual packed_material pack() const override {
+                packed_material packed;
+                packed.type = material_type::metal;
+                packed.albedo = albedo;
+                packed.fuzz = fuzz;
+                return packed;
             }
         public:
             color albedo;
@@ -60,41 +166,43 @@ namespace RAYTRACING {
             dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
             virtual bool scatter(
-                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng
             ) const override {
-                attenuation = color(1.0, 1.0, 1.0);
-                double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
-
-                vec3 unit_direction = unit_vector(r_in.direction());
-                double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-                double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
-
-                bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-                vec3 direction;
+                return scatter_dielectric(ir, r_in, rec, attenuation, scattered, rng);
+            }
 
-                if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
-                    direction = reflect(unit_direction, rec.normal);
-                else
-                    direction = refract(unit_direction, rec.normal, refraction_ratio);
+            virtual material* copy_to(arena& scene_arena) const override {
+                return scene_arena.create<dielectric>(*this);
+            }
 
-                scattered = ray(rec.p, direction);
-                return true;
+            virtual packed_material pack() const override {
+                packed_material packed;
+                packed.type = material_type::dielectric;
+                packed.ir = ir;
+                return packed;
             }
         public:
             double ir; // Index of refraction
-        private:
-            /**
-             * Use Schlick's approximation for reflectance.
-            */
-            static double reflectance(double cosine, double ref_idx) {
-                // Use Schlick's approximation for reflectance.
-                auto r0 = (1 - ref_idx) / (1 + ref_idx);
-                r0 = r0 * r0;
-                return r0 + (1 - r0) * pow((1 - cosine), 5);
-            }
         };
 
+        /**
+         * Scatter at a hit, through the switch if the hit has a packed material (hits on compiled scenes) and through
+         * the virtual call otherwise.
+        */
+        inline bool scatter_hit(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& rng) {
+            if (rec.packed_mat) {
+                const packed_material& m = *rec.packed_mat;
+                switch (m.type) {
+                case material_type::lambertian: return scatter_lambertian(m.albedo, rec, attenuation, scattered, rng);
+                case material_type::metal: return scatter_metal(m.albedo, m.fuzz, r_in, rec, attenuation, scattered, rng);
+                case material_type::dielectric: return scatter_dielectric(m.ir, r_in, rec, attenuation, scattered, rng);
+                case material_type::virtual_call: break;
+                }
+            }
+            return rec.mat_ptr->scatter(r_in, rec, attenuation, scattered, rng);
+        }
+
     }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,338 @@
+#pragma once
+
+#ifndef MATERIAL_BATCH_H
+#define MATERIAL_BATCH_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "simd.h"
+
+#include <vector>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Hits on one built in material type in structure of arrays layout, input and output of scatter_hits.
+		 * The caller fills count entries of the inputs, scatter_hits fills the outputs. Scattered rays start at the hit point.
+		*/
+		struct hit_batch {
+			int count = 0;
+
+			// Inputs
+			std::vector<double> point_x, point_y, point_z;
+			std::vector<double> normal_x, normal_y, normal_z;
+			std::vector<double> direction_x, direction_y, direction_z; // Of the incoming ray
+			std::vector<double> front_face;                            // 1 or 0, a double so it loads like the rest
+			std::vector<double> albedo_r, albedo_g, albedo_b;
+			std::vector<double> fuzz, ir;
+
+			// Outputs
+			std::vector<double> scattered_x, scattered_y, scattered_z;
+			std::vector<double> attenuation_r, attenuation_g, attenuation_b;
+			std::vector<double> alive; // 1 if the ray scattered, 0 if it was absorbed
+
+			// Uniform numbers, random_per_hit per hit
+			std::vector<double> random;
+
+			/**
+			 * Set the count and make room for it, the contents are left as they are.
+			*/
+			void resize(int n) {
+				count = n;
+				if ((int)alive.size() >= n) return;
+
+				for (std::vector<double>* component : { &point_x, &point_y, &point_z, &normal_x, &normal_y, &normal_z, &direction_x, &direction_y, &direction_z,
+					&front_face, &albedo_r, &albedo_g, &albedo_b, &fuzz, &ir, &scattered_x, &scattered_y, &scattered_z,
+					&attenuation_r, &attenuation_g, &attenuation_b, &alive }) {
+					component->resize(n);
+				}
+				random.resize((size_t)n * random_per_hit);
+			}
+
+			/**
+			 * Store hit i of the batch.
+			*/
+			void set(int i, const ray& r_in, const hit_record& rec, const packed_material& m) {
+				point_x[i] = rec.p.x(); point_y[i] = rec.p.y(); point_z[i] = rec.p.z();
+				normal_x[i] = rec.normal.x(); normal_y[i] = rec.normal.y(); normal_z[i] = rec.normal.z();
+				direction_x[i] = r_in.dir.x(); direction_y[i] = r_in.dir.y(); direction_z[i] = r_in.dir.z();
+				front_face[i] = rec.front_face ? 1.0 : 0.0;
+				albedo_r[i] = m.albedo.x(); albedo_g[i] = m.albedo.y(); albedo_b[i] = m.albedo.z();
+				fuzz[i] = m.fuzz;
+				ir[i] = m.ir;
+			}
+
+			ray scattered(int i) const {
+				return ray(point3(point_x[i], point_y[i], point_z[i]), vec3(scattered_x[i], scattered_y[i], scattered_z[i]));
+			}
+
+			color attenuation(int i) const {
+				return color(attenuation_r[i], attenuation_g[i], attenuation_b[i]);
+			}
+
+			// Lambertian takes 2 (a direction), metal 5 (a direction and a radius), dielectric 1
+			static constexpr int random_per_hit = 5;
+		};
+
+		namespace material_batch_detail {
+
+			inline void scatter_scalar(material_type type, hit_batch& batch, int first, sampler& rng) {
+				for (int i = first; i < batch.count; i++) {
+					hit_record rec;
+					rec.p = point3(batch.point_x[i], batch.point_y[i], batch.point_z[i]);
+					rec.normal = vec3(batch.normal_x[i], batch.normal_y[i], batch.normal_z[i]);
+					rec.front_face = batch.front_face[i] != 0.0;
+					ray r_in(rec.p, vec3(batch.direction_x[i], batch.direction_y[i], batch.direction_z[i]));
+					color albedo(batch.albedo_r[i], batch.albedo_g[i], batch.albedo_b[i]);
+
+					ray scattered;
+					color attenuation;
+					bool alive = false;
+					switch (type) {
+					case material_type::lambertian: alive = scatter_lambertian(albedo, rec, attenuation, scattered, rng); break;
+					case material_type::metal: alive = scatter_metal(albedo, batch.fuzz[i], r_in, rec, attenuation, scattered, rng); break;
+					case material_type::dielectric: alive = scatter_dielectric(batch.ir[i], r_in, rec, attenuation, scattered, rng); break;
+					case material_type::virtual_call: break;
+					}
+
+					batch.scattered_x[i] = scattered.dir.x(); batch.scattered_y[i] = scattered.dir.y(); batch.scattered_z[i] = scattered.dir.z();
+					batch.attenuation_r[i] = attenuation.x(); batch.attenuation_g[i] = attenuation.y(); batch.attenuation_b[i] = attenuation.z();
+					batch.alive[i] = alive ? 1.0 : 0.0;
+				}
+			}
+
+#if RT_SIMD_SSE
+			/**
+			 * Uniformly distributed unit vectors from two uniform numbers each, without the rejection loop of random_unit_vector.
+			 * z is uniform in [-1, 1], the angle around z comes from a short sine and cosine series.
+			*/
+			RT_TARGET_AVX2 RT_FORCE_INLINE void unit_vector_avx2(__m256d u1, __m256d u2, __m256d& x, __m256d& y, __m256d& z) {
+				const __m256d one = _mm256_set1_pd(1.0);
+
+				z = _mm256_sub_pd(one, _mm256_add_pd(u1, u1));
+				__m256d r = _mm256_sqrt_pd(_mm256_max_pd(_mm256_setzero_pd(), _mm256_sub_pd(one, _mm256_mul_pd(z, z))));
+
+				// Quadrant q and an angle a in [-pi/4, pi/4) around its middle
+				__m256d scaled = _mm256_mul_pd(u2, _mm256_set1_pd(4.0));
+				__m256d q = _mm256_floor_pd(scaled);
+				__m256d a = _mm256_mul_pd(_mm256_sub_pd(_mm256_sub_pd(scaled, q), _mm256_set1_pd(0.5)), _mm256_set1_pd(pi / 2));
+				__m256d a2 = _mm256_mul_pd(a, a);
+
+				// Taylor series to a^13, the error is below 1e-12 on this range
+				__m256d s = _mm256_set1_pd(1.0 / 6227020800.0);
+				s = _mm256_add_pd(_mm256_mul_pd(s, a2), _mm256_set1_pd(-1.0 / 39916800.0));
+				s = _mm256_add_pd(_mm256_mul_pd(s, a2), _mm256_set1_pd(1.0 / 362880.0));
+				s = _mm256_add_pd(_mm256_mul_pd(s, a2), _mm256_set1_pd(-1.0 / 5040.0));
+				s = _mm256_add_pd(_mm256_mul_pd(s, a2), _mm256_set1_pd(1.0 / 120.0));
+				s = _mm256_add_pd(_mm256_mul_pd(s, a2), _mm256_set1_pd(-1.0 / 6.0));
+				s = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(s, a2), a), a);
+
+				__m256d c = _mm256_set1_pd(1.0 / 479001600.0);
+				c = _mm256_add_pd(_mm256_mul_pd(c, a2), _mm256_set1_pd(-1.0 / 3628800.0));
+				c = _mm256_add_pd(_mm256_mul_pd(c, a2), _mm256_set1_pd(1.0 / 40320.0));
+				c = _mm256_add_pd(_mm256_mul_pd(c, a2), _mm256_set1_pd(-1.0 / 720.0));
+				c = _mm256_add_pd(_mm256_mul_pd(c, a2), _mm256_set1_pd(1.0 / 24.0));
+				c = _mm256_add_pd(_mm256_mul_pd(c, a2), _mm256_set1_pd(-0.5));
+				c = _mm256_add_pd(_mm256_mul_pd(c, a2), one);
+
+				// Rotate by pi/4 to the start of the quadrant range, then by q quarter turns
+				const __m256d half_sqrt2 = _mm256_set1_pd(0.70710678118654752440);
+				__m256d cos_a = _mm256_mul_pd(_mm256_sub_pd(c, s), half_sqrt2);
+				__m256d sin_a = _mm256_mul_pd(_mm256_add_pd(s, c), half_sqrt2);
+
+				__m256i qi = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(q));
+				__m256d odd = _mm256_castsi256_pd(_mm256_slli_epi64(qi, 63));                          // Sign bit set for q = 1, 3
+				__m256d upper = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_srli_epi64(qi, 1), 63)); // Sign bit set for q = 2, 3
+
+				// A quarter turn maps (cos, sin) to (-sin, cos)
+				__m256d cos_q = _mm256_blendv_pd(cos_a, _mm256_xor_pd(sin_a, _mm256_set1_pd(-0.0)), odd);
+				__m256d sin_q = _mm256_blendv_pd(sin_a, cos_a, odd);
+				cos_q = _mm256_xor_pd(cos_q, upper);
+				sin_q = _mm256_xor_pd(sin_q, upper);
+
+				x = _mm256_mul_pd(r, cos_q);
+				y = _mm256_mul_pd(r, sin_q);
+			}
+
+			RT_TARGET_AVX2 RT_FORCE_INLINE __m256d dot_avx2(__m256d ax, __m256d ay, __m256d az, __m256d bx, __m256d by, __m256d bz) {
+				return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ax, bx), _mm256_mul_pd(ay, by)), _mm256_mul_pd(az, bz));
+			}
+
+			RT_TARGET_AVX2 inline void scatter_lambertian_avx2(hit_batch& batch, int count) {
+				const double* u = batch.random.data();
+				const __m256d near_zero = _mm256_set1_pd(1e-8);
+				const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+
+				for (int i = 0; i + 4 <= count; i += 4) {
+					__m256d x, y, z;
+					unit_vector_avx2(_mm256_loadu_pd(u + i), _mm256_loadu_pd(u + count + i), x, y, z);
+
+					__m256d nx = _mm256_loadu_pd(&batch.normal_x[i]);
+					__m256d ny = _mm256_loadu_pd(&batch.normal_y[i]);
+					__m256d nz = _mm256_loadu_pd(&batch.normal_z[i]);
+					x = _mm256_add_pd(nx, x);
+					y = _mm256_add_pd(ny, y);
+					z = _mm256_add_pd(nz, z);
+
+					// Catch degenerate scatter direction
+					__m256d small = _mm256_and_pd(_mm256_and_pd(
+						_mm256_cmp_pd(_mm256_and_pd(x, abs_mask), near_zero, _CMP_LT_OQ),
+						_mm256_cmp_pd(_mm256_and_pd(y, abs_mask), near_zero, _CMP_LT_OQ)),
+						_mm256_cmp_pd(_mm256_and_pd(z, abs_mask), near_zero, _CMP_LT_OQ));
+
+					_mm256_storeu_pd(&batch.scattered_x[i], _mm256_blendv_pd(x, nx, small));
+					_mm256_storeu_pd(&batch.scattered_y[i], _mm256_blendv_pd(y, ny, small));
+					_mm256_storeu_pd(&batch.scattered_z[i], _mm256_blendv_pd(z, nz, small));
+					_mm256_storeu_pd(&batch.attenuation_r[i], _mm256_loadu_pd(&batch.albedo_r[i]));
+					_mm256_storeu_pd(&batch.attenuation_g[i], _mm256_loadu_pd(&batch.albedo_g[i]));
+					_mm256_storeu_pd(&batch.attenuation_b[i], _mm256_loadu_pd(&batch.albedo_b[i]));
+					_mm256_storeu_pd(&batch.alive[i], _mm256_set1_pd(1.0));
+				}
+			}
+
+			RT_TARGET_AVX2 inline void scatter_metal_avx2(hit_batch& batch, int count) {
+				const double* u = batch.random.data();
+				const __m256d two = _mm256_set1_pd(2.0);
+
+				for (int i = 0; i + 4 <= count; i += 4) {
+					__m256d dx = _mm256_loadu_pd(&batch.direction_x[i]);
+					__m256d dy = _mm256_loadu_pd(&batch.direction_y[i]);
+					__m256d dz = _mm256_loadu_pd(&batch.direction_z[i]);
+					__m256d inverse_length = _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_sqrt_pd(dot_avx2(dx, dy, dz, dx, dy, dz)));
+					dx = _mm256_mul_pd(dx, inverse_length);
+					dy = _mm256_mul_pd(dy, inverse_length);
+					dz = _mm256_mul_pd(dz, inverse_length);
+
+					__m256d nx = _mm256_loadu_pd(&batch.normal_x[i]);
+					__m256d ny = _mm256_loadu_pd(&batch.normal_y[i]);
+					__m256d nz = _mm256_loadu_pd(&batch.normal_z[i]);
+
+					// reflect(v, n) = v - 2 dot(v, n) n
+					__m256d twice_dot = _mm256_mul_pd(two, dot_avx2(dx, dy, dz, nx, ny, nz));
+					__m256d rx = _mm256_sub_pd(dx, _mm256_mul_pd(twice_dot, nx));
+					__m256d ry = _mm256_sub_pd(dy, _mm256_mul_pd(twice_dot, ny));
+					__m256d rz = _mm256_sub_pd(dz, _mm256_mul_pd(twice_dot, nz));
+
+					// A point in the unit ball: a direction and the largest of three uniforms as radius, which has the r^2 density of the ball
+					__m256d bx, by, bz;
+					unit_vector_avx2(_mm256_loadu_pd(u + i), _mm256_loadu_pd(u + count + i), bx, by, bz);
+					__m256d radius = _mm256_max_pd(_mm256_max_pd(_mm256_loadu_pd(u + 2 * count + i), _mm256_loadu_pd(u + 3 * count + i)), _mm256_loadu_pd(u + 4 * count + i));
+					__m256d scale = _mm256_mul_pd(radius, _mm256_loadu_pd(&batch.fuzz[i]));
+
+					__m256d sx = _mm256_add_pd(rx, _mm256_mul_pd(scale, bx));
+					__m256d sy = _mm256_add_pd(ry, _mm256_mul_pd(scale, by));
+					__m256d sz = _mm256_add_pd(rz, _mm256_mul_pd(scale, bz));
+
+					__m256d alive = _mm256_and_pd(_mm256_cmp_pd(dot_avx2(sx, sy, sz, nx, ny, nz), _mm256_setzero_pd(), _CMP_GT_OQ), _mm256_set1_pd(1.0));
+
+					_mm256_storeu_pd(&batch.scattered_x[i], sx);
+					_mm256_storeu_pd(&batch.scattered_y[i], sy);
+					_mm256_storeu_pd(&batch.scattered_z[i], sz);
+					_mm256_storeu_pd(&batch.attenuation_r[i], _mm256_loadu_pd(&batch.albedo_r[i]));
+					_mm256_storeu_pd(&batch.attenuation_g[i], _mm256_loadu_pd(&batch.albedo_g[i]));
+					_mm256_storeu_pd(&batch.attenuation_b[i], _mm256_loadu_pd(&batch.albedo_b[i]));
+					_mm256_storeu_pd(&batch.alive[i], alive);
+				}
+			}
+
+			RT_TARGET_AVX2 inline void scatter_dielectric_avx2(hit_batch& batch, int count) {
+				const double* u = batch.random.data();
+				const __m256d one = _mm256_set1_pd(1.0);
+				const __m256d two = _mm256_set1_pd(2.0);
+				const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+
+				for (int i = 0; i + 4 <= count; i += 4) {
+					__m256d dx = _mm256_loadu_pd(&batch.direction_x[i]);
+					__m256d dy = _mm256_loadu_pd(&batch.direction_y[i]);
+					__m256d dz = _mm256_loadu_pd(&batch.direction_z[i]);
+					__m256d inverse_length = _mm256_div_pd(one, _mm256_sqrt_pd(dot_avx2(dx, dy, dz, dx, dy, dz)));
+					dx = _mm256_mul_pd(dx, inverse_length);
+					dy = _mm256_mul_pd(dy, inverse_length);
+					dz = _mm256_mul_pd(dz, inverse_length);
+
+					__m256d nx = _mm256_loadu_pd(&batch.normal_x[i]);
+					__m256d ny = _mm256_loadu_pd(&batch.normal_y[i]);
+					__m256d nz = _mm256_loadu_pd(&batch.normal_z[i]);
+
+					__m256d ir = _mm256_loadu_pd(&batch.ir[i]);
+					__m256d front = _mm256_cmp_pd(_mm256_loadu_pd(&batch.front_face[i]), _mm256_setzero_pd(), _CMP_NEQ_OQ);
+					__m256d ratio = _mm256_blendv_pd(ir, _mm256_div_pd(one, ir), front);
+
+					__m256d d_dot_n = dot_avx2(dx, dy, dz, nx, ny, nz);
+					__m256d cos_theta = _mm256_min_pd(_mm256_sub_pd(_mm256_setzero_pd(), d_dot_n), one);
+					__m256d sin_theta = _mm256_sqrt_pd(_mm256_sub_pd(one, _mm256_mul_pd(cos_theta, cos_theta)));
+					__m256d cannot_refract = _mm256_cmp_pd(_mm256_mul_pd(ratio, sin_theta), one, _CMP_GT_OQ);
+
+					// Schlick's approximation for reflectance
+					__m256d r0 = _mm256_div_pd(_mm256_sub_pd(one, ratio), _mm256_add_pd(one, ratio));
+					r0 = _mm256_mul_pd(r0, r0);
+					__m256d m = _mm256_sub_pd(one, cos_theta);
+					__m256d m2 = _mm256_mul_pd(m, m);
+					__m256d m5 = _mm256_mul_pd(_mm256_mul_pd(m2, m2), m);
+					__m256d reflectance = _mm256_add_pd(r0, _mm256_mul_pd(_mm256_sub_pd(one, r0), m5));
+					__m256d reflects = _mm256_or_pd(cannot_refract, _mm256_cmp_pd(reflectance, _mm256_loadu_pd(u + i), _CMP_GT_OQ));
+
+					// reflect(v, n) = v - 2 dot(v, n) n
+					__m256d twice_dot = _mm256_mul_pd(two, d_dot_n);
+					__m256d rx = _mm256_sub_pd(dx, _mm256_mul_pd(twice_dot, nx));
+					__m256d ry = _mm256_sub_pd(dy, _mm256_mul_pd(twice_dot, ny));
+					__m256d rz = _mm256_sub_pd(dz, _mm256_mul_pd(twice_dot, nz));
+
+					// refract(v, n, ratio) = ratio (v + cos n) - sqrt(|1 - |perp|^2|) n
+					__m256d px = _mm256_mul_pd(ratio, _mm256_add_pd(dx, _mm256_mul_pd(cos_theta, nx)));
+					__m256d py = _mm256_mul_pd(ratio, _mm256_add_pd(dy, _mm256_mul_pd(cos_theta, ny)));
+					__m256d pz = _mm256_mul_pd(ratio, _mm256_add_pd(dz, _mm256_mul_pd(cos_theta, nz)));
+					__m256d parallel = _mm256_sqrt_pd(_mm256_and_pd(_mm256_sub_pd(one, dot_avx2(px, py, pz, px, py, pz)), abs_mask));
+					__m256d tx = _mm256_sub_pd(px, _mm256_mul_pd(parallel, nx));
+					__m256d ty = _mm256_sub_pd(py, _mm256_mul_pd(parallel, ny));
+					__m256d tz = _mm256_sub_pd(pz, _mm256_mul_pd(parallel, nz));
+
+					_mm256_storeu_pd(&batch.scattered_x[i], _mm256_blendv_pd(tx, rx, reflects));
+					_mm256_storeu_pd(&batch.scattered_y[i], _mm256_blendv_pd(ty, ry, reflects));
+					_mm256_storeu_pd(&batch.scattered_z[i], _mm256_blendv_pd(tz, rz, reflects));
+					_mm256_storeu_pd(&batch.attenuation_r[i], one);
+					_mm256_storeu_pd(&batch.attenuation_g[i], one);
+					_mm256_storeu_pd(&batch.attenuation_b[i], one);
+					_mm256_storeu_pd(&batch.alive[i], one);
+				}
+			}
+#endif
+
+		}
+
+		/**
+		 * Scatter every hit of a batch of one built in material type. With AVX2 four hits are scattered at once, branch free,
+		 * with closed form direction sampling instead of rejection loops. The random numbers are drawn in a different order
+		 * than by the scalar scatter functions, so the results match those in distribution, not sample by sample.
+		*/
+		inline void scatter_hits(material_type type, hit_batch& batch, sampler& rng) {
+			int first = 0;
+
+#if RT_SIMD_SSE
+			const int vector_count = batch.count & ~3;
+			if (cpu_has_avx2() && vector_count > 0) {
+				// Component k of the random numbers of hit i is at [k * vector_count + i]
+				const int needed = type == material_type::lambertian ? 2 : type == material_type::metal ? 5 : 1;
+				for (int k = 0; k < needed * vector_count; k++) {
+					batch.random[k] = rng.next_double();
+				}
+
+				switch (type) {
+				case material_type::lambertian: material_batch_detail::scatter_lambertian_avx2(batch, vector_count); break;
+				case material_type::metal: material_batch_detail::scatter_metal_avx2(batch, vector_count); break;
+				case material_type::dielectric: material_batch_detail::scatter_dielectric_avx2(batch, vector_count); break;
+				case material_type::virtual_call: return;
+				}
+				first = vector_count;
+			}
+#endif
+			material_batch_detail::scatter_scalar(type, batch, first, rng);
+		}
+
+	}
+}
+
+#endif // !MATERIAL_BATCH_H
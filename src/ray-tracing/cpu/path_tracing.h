@@ -0,0 +1,63 @@
+#pragma once
+
+#ifndef PATH_TRACING_H
+#define PATH_TRACING_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * A path in flight: the ray to trace next, the fraction of light that still reaches the camera through the bounces
+		 * so far, and the light gathered.
+		*/
+		struct path_state {
+			ray r;
+			color throughput = color(1, 1, 1);
+			color radiance = color(0, 0, 0);
+			int bounces = 0;
+
+			explicit path_state(const ray& r) : r(r) {}
+		};
+
+		// Bounces every path gets before Russian roulette may end it
+		constexpr int roulette_min_bounces = 3;
+		// Paths whose brightest throughput channel is above this always continue, dimmer ones survive proportionally
+		constexpr double roulette_throughput = 0.25;
+
+		inline color sky_color(const ray& r) {
+			vec3 unit_direction = unit_vector(r.direction());
+			auto t = 0.5 * (unit_direction.y() + 1.0);
+			return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+		}
+
+		/**
+		 * Decide whether a path goes on after its latest bounce. After roulette_min_bounces a path whose throughput fell
+		 * below roulette_throughput survives with a probability following it, and survivors are weighted up by its inverse,
+		 * so dim paths end early without biasing the estimate. Bright paths are left alone, ending them only adds noise.
+		 * @param throughput Throughput including the latest bounce, reweighted if the path survives the roulette
+		 * @param bounces Bounces so far
+		*/
+		inline bool continue_path(color& throughput, int bounces, sampler& rng) {
+			// Nothing can reach the camera through a black surface
+			if (throughput.x() <= 0 && throughput.y() <= 0 && throughput.z() <= 0) return false;
+
+			if (bounces < roulette_min_bounces) return true;
+
+			// The brightest channel rather than the luminance, so saturated paths are not weighted up into fireflies
+			double survival = std::max({ throughput.x(), throughput.y(), throughput.z() }) / roulette_throughput;
+			if (survival >= 1.0) return true;
+
+			if (rng.next_double() >= survival) return false;
+			throughput /= survival;
+			return true;
+		}
+
+	}
+}
+
+#endif // !PATH_TRACING_H
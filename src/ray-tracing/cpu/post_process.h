@@ -0,0 +1,363 @@
+#pragma once
+
+#ifndef POST_PROCESS_H
+#define POST_PROCESS_H
+
+#include "rtweekend.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		enum class tonemap_operator {
+			none,	// Clip at 1
+			filmic,	// Hable's filmic curve
+			aces	// Narkowicz's fit of the ACES reference transform
+		};
+
+		enum class gamma_curve {
+			gamma_2,	// sqrt, what correct_color_and_gamma does
+			srgb,		// Exact sRGB transfer function
+			srgb_fast	// sqrt based fit of sRGB, within a quarter step of 8 bit
+		};
+
+		/**
+		 * Settings for turning accumulated radiance into 8 bit pixels. The defaults give the same bytes as
+		 * correct_color_and_gamma followed by the usual 256 * clamp(x, 0, 0.999).
+		*/
+		struct post_settings {
+			double exposure = 1.0; // Scale applied after dividing by the sample count
+			tonemap_operator tonemap = tonemap_operator::none;
+			gamma_curve gamma = gamma_curve::gamma_2;
+			bool dither = false; // Ordered 4x4 dither before quantizing, hides banding in dark gradients
+		};
+
+		namespace post_detail {
+
+			// Everything a kernel needs, derived once per span
+			struct params {
+				float scale;		// exposure / samples
+				float exposure;		// For spans with a sample count per pixel
+				float quant_scale;	// 256 truncates like the old conversion, 255 when dithering adds [0, 1)
+				float filmic_white;	// 1 / filmic(white point)
+				tonemap_operator tonemap;
+				gamma_curve gamma;
+			};
+
+			constexpr float filmic_exposure_bias = 2.0f;
+			constexpr float filmic_white_point = 11.2f;
+
+			inline float filmic_curve(float x) {
+				const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+				return (x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F) - E / F;
+			}
+
+			inline params make_params(double samples_per_pixel, const post_settings& settings) {
+				params p;
+				p.scale = (float)(settings.exposure / samples_per_pixel);
+				p.exposure = (float)settings.exposure;
+				p.quant_scale = settings.dither ? 255.0f : 256.0f;
+				p.filmic_white = 1.0f / filmic_curve(filmic_white_point);
+				p.tonemap = settings.tonemap;
+				p.gamma = settings.gamma;
+				return p;
+			}
+
+			/**
+			 * Dither offsets for a group of 8 pixels starting at (x, y), one per channel. The 4x4 pattern repeats every 4 pixels,
+			 * so the same 24 values serve every group of the span.
+			*/
+			inline void dither_group(int x, int y, bool dither, float* offsets) {
+				static const float bayer[4][4] = {
+					{ 0, 8, 2, 10 },
+					{ 12, 4, 14, 6 },
+					{ 3, 11, 1, 9 },
+					{ 15, 7, 13, 5 }
+				};
+
+				for (int i = 0; i < 8; i++) {
+					float d = dither ? (bayer[y & 3][(x + i) & 3] + 0.5f) / 16.0f : 0.0f;
+					offsets[3 * i] = offsets[3 * i + 1] = offsets[3 * i + 2] = d;
+				}
+			}
+
+			/**
+			 * One channel from accumulated radiance to a quantization level in [0, 255], not yet truncated.
+			*/
+			inline float convert_scalar(float v, float scale, const params& p, float dither) {
+				v *= scale;
+				v = v > 0.0f ? v : 0.0f; // Also catches NaN from unsampled pixels
+
+				switch (p.tonemap) {
+				case tonemap_operator::none: break;
+				case tonemap_operator::filmic: v = filmic_curve(v * filmic_exposure_bias) * p.filmic_white; break;
+				case tonemap_operator::aces: v = (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f); break;
+				}
+
+				v = v < 1.0f ? v : 1.0f;
+
+				switch (p.gamma) {
+				case gamma_curve::gamma_2:
+					v = std::sqrt(v);
+					break;
+				case gamma_curve::srgb:
+					v = v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+					break;
+				case gamma_curve::srgb_fast: {
+					// The fit goes negative close to zero, where the linear segment takes over anyway
+					float s1 = std::sqrt(v), s2 = std::sqrt(s1), s3 = std::sqrt(s2);
+					v = v <= 0.0031308f ? 12.92f * v : 0.662002687f * s1 + 0.684122060f * s2 - 0.323583601f * s3 - 0.0225411470f * v;
+					break;
+				}
+				}
+
+				float q = v * p.quant_scale + dither;
+				return q < 255.0f ? q : 255.0f;
+			}
+
+			inline void convert_span_scalar(const double* in, const int* sample_counts, int first, int count, const params& p, const float* dither, unsigned char* out, int channels) {
+				for (int i = first; i < count; i++) {
+					float scale = sample_counts ? p.exposure / sample_counts[i] : p.scale;
+					for (int c = 0; c < 3; c++) {
+						out[channels * i + c] = (unsigned char)convert_scalar((float)in[3 * i + c], scale, p, dither[(i & 7) * 3 + c]);
+					}
+					if (channels == 4) out[4 * i + 3] = 255;
+				}
+			}
+
+#if RT_SIMD_SSE
+			RT_TARGET_AVX2 RT_FORCE_INLINE __m256 log2_avx2(__m256 x) {
+				__m256i bits = _mm256_castps_si256(x);
+				__m256 exponent = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+				__m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f800000)));
+
+				// Mantissas above sqrt(2) move down an octave so the series argument stays below 0.18
+				__m256 high = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+				m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), high);
+				exponent = _mm256_add_ps(exponent, _mm256_and_ps(high, _mm256_set1_ps(1.0f)));
+
+				// log2(m) = 2 / ln(2) * atanh(t) with t = (m - 1) / (m + 1)
+				__m256 t = _mm256_div_ps(_mm256_sub_ps(m, _mm256_set1_ps(1.0f)), _mm256_add_ps(m, _mm256_set1_ps(1.0f)));
+				__m256 t2 = _mm256_mul_ps(t, t);
+				__m256 series = _mm256_set1_ps(1.0f / 9.0f);
+				series = _mm256_add_ps(_mm256_mul_ps(series, t2), _mm256_set1_ps(1.0f / 7.0f));
+				series = _mm256_add_ps(_mm256_mul_ps(series, t2), _mm256_set1_ps(1.0f / 5.0f));
+				series = _mm256_add_ps(_mm256_mul_ps(series, t2), _mm256_set1_ps(1.0f / 3.0f));
+				series = _mm256_add_ps(_mm256_mul_ps(series, t2), _mm256_set1_ps(1.0f));
+
+				return _mm256_add_ps(exponent, _mm256_mul_ps(_mm256_mul_ps(series, t), _mm256_set1_ps(2.88539008f)));
+			}
+
+			RT_TARGET_AVX2 RT_FORCE_INLINE __m256 exp2_avx2(__m256 y) {
+				y = _mm256_max_ps(y, _mm256_set1_ps(-126.0f));
+				__m256 n = _mm256_floor_ps(y);
+				__m256 f = _mm256_sub_ps(y, n);
+
+				// Taylor series of 2^f on [0, 1), relative error below 2e-5
+				__m256 p = _mm256_set1_ps(1.5403530e-4f);
+				p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.3333558e-3f));
+				p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(9.6181291e-3f));
+				p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(5.5504109e-2f));
+				p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(2.4022651e-1f));
+				p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(6.9314718e-1f));
+				p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.0f));
+
+				__m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+				return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+			}
+
+			/**
+			 * convert_scalar on 8 channels at once. The curves are template arguments so every kernel is branch free.
+			*/
+			template<tonemap_operator tonemap, gamma_curve gamma>
+			RT_TARGET_AVX2 RT_FORCE_INLINE __m256 convert_avx2(__m256 v, __m256 scale, const params& p, __m256 dither) {
+				const __m256 zero = _mm256_setzero_ps();
+				const __m256 one = _mm256_set1_ps(1.0f);
+
+				v = _mm256_mul_ps(v, scale);
+				v = _mm256_max_ps(v, zero); // Returns the second operand for NaN
+
+				if constexpr (tonemap == tonemap_operator::filmic) {
+					const __m256 A = _mm256_set1_ps(0.15f), B = _mm256_set1_ps(0.50f);
+					__m256 x = _mm256_mul_ps(v, _mm256_set1_ps(filmic_exposure_bias));
+					__m256 numerator = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(A, x), _mm256_set1_ps(0.10f * 0.50f))), _mm256_set1_ps(0.20f * 0.02f));
+					__m256 denominator = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(A, x), B)), _mm256_set1_ps(0.20f * 0.30f));
+					v = _mm256_sub_ps(_mm256_div_ps(numerator, denominator), _mm256_set1_ps(0.02f / 0.30f));
+					v = _mm256_mul_ps(v, _mm256_set1_ps(p.filmic_white));
+				}
+				else if constexpr (tonemap == tonemap_operator::aces) {
+					__m256 numerator = _mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(2.51f)), _mm256_set1_ps(0.03f)));
+					__m256 denominator = _mm256_add_ps(_mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(2.43f)), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+					v = _mm256_div_ps(numerator, denominator);
+				}
+
+				// Written with v first so a NaN from the tonemap becomes 1 rather than passing through
+				v = _mm256_min_ps(v, one);
+				v = _mm256_max_ps(v, zero);
+
+				if constexpr (gamma == gamma_curve::gamma_2) {
+					v = _mm256_sqrt_ps(v);
+				}
+				else if constexpr (gamma == gamma_curve::srgb) {
+					__m256 linear = _mm256_mul_ps(v, _mm256_set1_ps(12.92f));
+					__m256 curve = exp2_avx2(_mm256_mul_ps(log2_avx2(v), _mm256_set1_ps(1.0f / 2.4f)));
+					curve = _mm256_sub_ps(_mm256_mul_ps(curve, _mm256_set1_ps(1.055f)), _mm256_set1_ps(0.055f));
+					v = _mm256_blendv_ps(curve, linear, _mm256_cmp_ps(v, _mm256_set1_ps(0.0031308f), _CMP_LE_OQ));
+				}
+				else {
+					__m256 s1 = _mm256_sqrt_ps(v);
+					__m256 s2 = _mm256_sqrt_ps(s1);
+					__m256 s3 = _mm256_sqrt_ps(s2);
+					__m256 r = _mm256_mul_ps(s1, _mm256_set1_ps(0.662002687f));
+					r = _mm256_add_ps(r, _mm256_mul_ps(s2, _mm256_set1_ps(0.684122060f)));
+					r = _mm256_sub_ps(r, _mm256_mul_ps(s3, _mm256_set1_ps(0.323583601f)));
+					r = _mm256_sub_ps(r, _mm256_mul_ps(v, _mm256_set1_ps(0.0225411470f)));
+					v = _mm256_blendv_ps(r, _mm256_mul_ps(v, _mm256_set1_ps(12.92f)), _mm256_cmp_ps(v, _mm256_set1_ps(0.0031308f), _CMP_LE_OQ));
+				}
+
+				__m256 q = _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(p.quant_scale)), dither);
+				return _mm256_min_ps(q, _mm256_set1_ps(255.0f));
+			}
+
+			/**
+			 * Eight pixels per iteration: 24 interleaved channels are converted as three float vectors, packed to bytes and
+			 * stored as RGB or expanded to RGBA. The tail goes through the scalar path.
+			 * With sample_counts every pixel is normalized by its own count, otherwise by the span's.
+			*/
+			template<tonemap_operator tonemap, gamma_curve gamma>
+			RT_TARGET_AVX2 void convert_span_avx2(const double* in, const int* sample_counts, int count, const params& p, const float* dither, unsigned char* out, int channels) {
+				const __m256 d0 = _mm256_loadu_ps(dither);
+				const __m256 d1 = _mm256_loadu_ps(dither + 8);
+				const __m256 d2 = _mm256_loadu_ps(dither + 16);
+
+				const __m128i to_rgba = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+				const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+				// Spread the scales of 8 pixels over their 24 channels
+				const __m256i spread0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+				const __m256i spread1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+				const __m256i spread2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+
+				__m256 s0 = _mm256_set1_ps(p.scale), s1 = s0, s2 = s0;
+
+				int i = 0;
+				for (; i + 8 <= count; i += 8) {
+					const double* src = in + 3 * i;
+
+					__m256 v0 = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(src + 4)), _mm256_cvtpd_ps(_mm256_loadu_pd(src)));
+					__m256 v1 = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(src + 12)), _mm256_cvtpd_ps(_mm256_loadu_pd(src + 8)));
+					__m256 v2 = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(src + 20)), _mm256_cvtpd_ps(_mm256_loadu_pd(src + 16)));
+
+					if (sample_counts) {
+						__m256 scales = _mm256_div_ps(_mm256_set1_ps(p.exposure), _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(sample_counts + i))));
+						s0 = _mm256_permutevar8x32_ps(scales, spread0);
+						s1 = _mm256_permutevar8x32_ps(scales, spread1);
+						s2 = _mm256_permutevar8x32_ps(scales, spread2);
+					}
+
+					__m256i q0 = _mm256_cvttps_epi32(convert_avx2<tonemap, gamma>(v0, s0, p, d0));
+					__m256i q1 = _mm256_cvttps_epi32(convert_avx2<tonemap, gamma>(v1, s1, p, d1));
+					__m256i q2 = _mm256_cvttps_epi32(convert_avx2<tonemap, gamma>(v2, s2, p, d2));
+
+					// Packs work within 128 bit lanes, so narrow the halves in order: bytes 0-15 and 16-23
+					__m128i w0 = _mm_packus_epi32(_mm256_castsi256_si128(q0), _mm256_extracti128_si256(q0, 1));
+					__m128i w1 = _mm_packus_epi32(_mm256_castsi256_si128(q1), _mm256_extracti128_si256(q1, 1));
+					__m128i w2 = _mm_packus_epi32(_mm256_castsi256_si128(q2), _mm256_extracti128_si256(q2, 1));
+					__m128i low = _mm_packus_epi16(w0, w1);
+					__m128i high = _mm_packus_epi16(w2, w2);
+
+					if (channels == 3) {
+						_mm_storeu_si128((__m128i*)(out + 3 * i), low);
+						_mm_storel_epi64((__m128i*)(out + 3 * i + 16), high);
+					}
+					else {
+						__m128i first = _mm_or_si128(_mm_shuffle_epi8(low, to_rgba), alpha);
+						__m128i second = _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(high, low, 12), to_rgba), alpha);
+						_mm_storeu_si128((__m128i*)(out + 4 * i), first);
+						_mm_storeu_si128((__m128i*)(out + 4 * i + 16), second);
+					}
+				}
+
+				convert_span_scalar(in, sample_counts, i, count, p, dither, out, channels);
+			}
+
+			using span_kernel = void (*)(const double* in, const int* sample_counts, int count, const params& p, const float* dither, unsigned char* out, int channels);
+
+			inline span_kernel select_avx2_kernel(tonemap_operator tonemap, gamma_curve gamma) {
+				using t = tonemap_operator;
+				using g = gamma_curve;
+				static const span_kernel kernels[3][3] = {
+					{ convert_span_avx2<t::none, g::gamma_2>, convert_span_avx2<t::none, g::srgb>, convert_span_avx2<t::none, g::srgb_fast> },
+					{ convert_span_avx2<t::filmic, g::gamma_2>, convert_span_avx2<t::filmic, g::srgb>, convert_span_avx2<t::filmic, g::srgb_fast> },
+					{ convert_span_avx2<t::aces, g::gamma_2>, convert_span_avx2<t::aces, g::srgb>, convert_span_avx2<t::aces, g::srgb_fast> }
+				};
+				return kernels[(int)tonemap][(int)gamma];
+			}
+#endif
+
+		}
+
+		namespace post_detail {
+
+			inline void convert_span(const color* pixels, const int* sample_counts, int count, double samples_per_pixel, int x, int y, const post_settings& settings, unsigned char* out, int channels) {
+				if (count <= 0) return;
+
+				const params p = make_params(samples_per_pixel, settings);
+				float dither[24];
+				dither_group(x, y, settings.dither, dither);
+
+				// color is three packed doubles, so a run of pixels is a flat array of channels
+				static_assert(sizeof(color) == 3 * sizeof(double), "color must be tightly packed");
+				const double* in = &pixels[0].e[0];
+
+#if RT_SIMD_SSE
+				if (cpu_has_avx2()) {
+					select_avx2_kernel(settings.tonemap, settings.gamma)(in, sample_counts, count, p, dither, out, channels);
+					return;
+				}
+#endif
+				convert_span_scalar(in, sample_counts, 0, count, p, dither, out, channels);
+			}
+
+		}
+
+		/**
+		 * Convert a run of accumulated pixels to 8 bit without modifying them.
+		 * @param samples_per_pixel Number of samples summed into every pixel of the run
+		 * @param x, y Image position of the first pixel, only used for the dither pattern
+		 * @param out Caller owned, 3 * count bytes for RGB or 4 * count for RGBA
+		 * @param channels 3 for RGB, 4 for RGBA with opaque alpha
+		*/
+		inline void post_process_span(const color* pixels, int count, double samples_per_pixel, int x, int y, const post_settings& settings, unsigned char* out, int channels = 4) {
+			post_detail::convert_span(pixels, nullptr, count, samples_per_pixel, x, y, settings, out, channels);
+		}
+
+		/**
+		 * Same for pixels that took different numbers of samples.
+		 * @param sample_counts Samples summed into each pixel
+		*/
+		inline void post_process_span(const color* pixels, const int* sample_counts, int count, int x, int y, const post_settings& settings, unsigned char* out, int channels = 4) {
+			post_detail::convert_span(pixels, sample_counts, count, 1.0, x, y, settings, out, channels);
+		}
+
+		/**
+		 * Convert a row major image on the thread pool, a block of rows per task.
+		*/
+		inline void post_process_image(const color* pixels, int width, int height, double samples_per_pixel, const post_settings& settings, unsigned char* out, int channels = 4) {
+			if (width <= 0) return;
+
+			int rows_per_task = std::max(1, 16384 / width);
+			thread_pool::global().parallel_for(height, [&](int y) {
+				post_process_span(pixels + (size_t)y * width, width, samples_per_pixel, 0, y, settings, out + (size_t)y * width * channels, channels);
+			}, -1, rows_per_task);
+		}
+
+	}
+}
+
+#endif // !POST_PROCESS_H
@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef PRIMITIVE_H
+#define PRIMITIVE_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "simd.h"
+
+#include <cstdint>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * A ray with the values every primitive test of it shares, computed once per ray.
+		*/
+		struct primitive_ray {
+			point3 origin;
+			vec3 direction;
+			double direction_length_squared;
+
+			explicit primitive_ray(const ray& r) : origin(r.orig), direction(r.dir), direction_length_squared(r.dir.length_squared()) {}
+		};
+
+		/**
+		 * How a compiled scene stores and intersects one hittable type. Specialize it for every type listed in a
+		 * basic_compiled_scene:
+		 *  - compiled: trivially copyable form stored in the scene, with a uint32_t material member indexing the scene's material tables
+		 *  - compile(source, material): the compiled form of a source object
+		 *  - material_of(source), bounds(source, box): material and bounds of a source object
+		 *  - intersect(compiled, ray, t_min, closest): if the primitive is hit in [t_min, closest] set closest to the distance and return true
+		 *  - surface(compiled, ray, t, rec): set t, p and the normal of rec for the hit at distance t. The scene fills in the material.
+		 * Traversal only runs intersect, surface runs once per ray for the closest hit it ends up with.
+		 * Everything is called without virtual dispatch, so intersect is inlined into the leaf loop.
+		*/
+		template<typename T>
+		struct primitive_traits;
+
+		/**
+		 * Sphere as stored by a compiled_scene, the material is an index into the scene's material tables.
+		*/
+		struct compiled_sphere {
+			point3 center;
+			double radius;
+			uint32_t material;
+		};
+
+		template<>
+		struct primitive_traits<sphere> {
+			using compiled = compiled_sphere;
+
+			static compiled_sphere compile(const sphere& s, uint32_t material) { return { s.center, s.radius, material }; }
+			static const material* material_of(const sphere& s) { return s.mat_ptr.get(); }
+			static bool bounds(const sphere& s, aabb& box) { return s.sphere::bounding_box(box); }
+
+			static RT_FORCE_INLINE bool intersect(const compiled_sphere& s, const primitive_ray& pr, double t_min, double& closest) {
+				const vec3 direction = pr.direction;
+				const double a = pr.direction_length_squared;
+
+				vec3 oc = pr.origin - s.center;
+				double half_b = dot(oc, direction);
+				double c = oc.length_squared() - s.radius * s.radius;
+
+				double discriminant = half_b * half_b - a * c;
+				if (discriminant < 0) return false;
+				double sqrtd = sqrt(discriminant);
+
+				// Find the nearest root that lies in the acceptable range.
+				double root = (-half_b - sqrtd) / a;
+				if (root < t_min || closest < root) {
+					root = (-half_b + sqrtd) / a;
+					if (root < t_min || closest < root) return false;
+				}
+
+				closest = root;
+				return true;
+			}
+
+			static RT_FORCE_INLINE void surface(const compiled_sphere& s, const primitive_ray& pr, double t, hit_record& rec) {
+				rec.t = t;
+				rec.p = pr.origin + t * pr.direction;
+				rec.set_face_normal(ray(pr.origin, pr.direction), (rec.p - s.center) / s.radius);
+			}
+		};
+
+	}
+}
+
+#endif // !PRIMITIVE_H
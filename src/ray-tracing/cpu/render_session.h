@@ -0,0 +1,281 @@
+#pragma once
+
+#ifndef RENDER_SESSION_H
+#define RENDER_SESSION_H
+
+#include "rt_cpu.h"
+#include "chunk_scheduler.h"
+
+#include "../../utility/tracelog.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * State of a progressive render as published by a RenderSession.
+		*/
+		struct RenderSnapshot
+		{
+			PixelChunkData_t* chunks = nullptr;
+			bool* renderChunk = nullptr; // Chunks that still needed samples after this pass
+			int passCount = 0;
+			double lastPassMs = 0;
+			uint64_t cameraVersion = 0; // Incremented by every setCamera call
+			bool finished = false;
+		};
+
+		/**
+		 * Runs progressive chunk passes on a background thread and the thread pool, so the UI thread never waits on tracing.
+		 * After every pass the accumulated image is published through a lock free triple buffer, the UI picks up the latest
+		 * one with latest() whenever it draws. Camera changes and stop() cancel the pass in flight, only chunks that are
+		 * already being traced finish.
+		*/
+		class RenderSession {
+		public:
+			/**
+			 * @param world Scene to render, must outlive the session and must not change while a pass runs (see beforePass)
+			 * @param max_samples Samples after which a pixel counts as done regardless of its noise
+			 * @param noise_threshold Sampling stops once the error estimate of the policy falls below this, see adaptive_settings
+			 * @param policy Error estimate, per pixel variance or the per chunk half buffer difference
+			*/
+			RenderSession(const hittable& world, int width, int height, int chunk_size, int max_depth, int max_samples, double noise_threshold, int thread_limit = -1,
+				convergence_policy policy = convergence_policy::pixel_variance)
+				: world(world), width(width), height(height), chunkSize(chunk_size), maxDepth(max_depth), threadLimit(thread_limit) {
+
+				adaptive.policy = policy;
+				adaptive.threshold = noise_threshold;
+				adaptive.max_samples = max_samples;
+				adaptive.min_samples = std::min(adaptive.min_samples, max_samples);
+
+				chunksWide = std::ceil(width / (float)chunk_size);
+				chunksTall = std::ceil(height / (float)chunk_size);
+				numberOfChunks = chunksWide * chunksTall;
+
+				accumulation = PixelChunkData_t::Build(width, height, chunk_size);
+				renderChunk = new bool[numberOfChunks];
+
+				for (RenderSnapshot& snapshot : snapshots) {
+					snapshot.chunks = PixelChunkData_t::Build(width, height, chunk_size);
+					snapshot.renderChunk = new bool[numberOfChunks];
+					std::fill(snapshot.renderChunk, snapshot.renderChunk + numberOfChunks, true);
+				}
+			}
+
+			RenderSession(const RenderSession&) = delete;
+			RenderSession& operator=(const RenderSession&) = delete;
+
+			~RenderSession() {
+				stop();
+
+				PixelChunkData_t::Free(accumulation, width, height, chunkSize);
+				delete[] renderChunk;
+
+				for (RenderSnapshot& snapshot : snapshots) {
+					PixelChunkData_t::Free(snapshot.chunks, width, height, chunkSize);
+					delete[] snapshot.renderChunk;
+				}
+			}
+
+			/**
+			 * Start the render thread. Nothing is rendered before the first setCamera call.
+			*/
+			void start() {
+				if (renderThread.joinable()) return;
+
+				stopping = false;
+				renderThread = std::thread([this]() { renderLoop(); });
+			}
+
+			/**
+			 * Cancel the pass in flight and join the render thread.
+			*/
+			void stop() {
+				{
+					std::lock_guard<std::mutex> lock(controlLock);
+					stopping = true;
+					currentPass.cancel();
+				}
+				wake.notify_all();
+
+				if (renderThread.joinable()) renderThread.join();
+			}
+
+			/**
+			 * Move the camera. The pass in flight is cancelled and accumulation starts over.
+			*/
+			void setCamera(point3 position, point3 look_at, double vfov) {
+				{
+					std::lock_guard<std::mutex> lock(controlLock);
+					cameraPosition = position;
+					cameraLookAt = look_at;
+					cameraVfov = vfov;
+					cameraVersion++;
+					currentPass.cancel();
+				}
+				wake.notify_all();
+			}
+
+			/**
+			 * Latest published state. Only call from one (the UI) thread, the returned snapshot stays valid until the next call.
+			 * Its passCount is zero until the first pass has been published.
+			*/
+			const RenderSnapshot& latest() {
+				// Swap the middle buffer in if the renderer published since the last call
+				if (shared.load(std::memory_order_relaxed) & fresh_bit) {
+					int previous = shared.exchange(front, std::memory_order_acq_rel);
+					front = previous & index_mask;
+				}
+				return snapshots[front];
+			}
+
+			int chunkCount() const { return numberOfChunks; }
+
+		public:
+			// Called on the render thread before every pass, e.g. to rebuild the acceleration structure of a moving scene
+			std::function<void()> beforePass;
+			// Decides how many samples each chunk gets per pass, configure before start()
+			chunk_scheduler scheduler;
+			// How passes trace their samples, configure before start()
+			integrator_mode integrator = integrator_mode::path;
+
+		private:
+			static constexpr int fresh_bit = 4;
+			static constexpr int index_mask = 3;
+
+			void resetAccumulation() {
+				for (int i = 0; i < numberOfChunks; i++) {
+					accumulation[i].clear();
+					renderChunk[i] = true;
+				}
+				passCount = 0;
+			}
+
+			/**
+			 * Bring the back buffer up to date and swap it with the middle one. Only chunks that changed since the back buffer
+			 * was last published are copied, which late in a render is a small part of the image.
+			*/
+			void publish(uint64_t version, double pass_ms, bool finished) {
+				RenderSnapshot& snapshot = snapshots[back];
+
+				copyChangedChunks(accumulation, snapshot.chunks, numberOfChunks);
+				std::copy(renderChunk, renderChunk + numberOfChunks, snapshot.renderChunk);
+				snapshot.passCount = passCount;
+				snapshot.lastPassMs = pass_ms;
+				snapshot.cameraVersion = version;
+				snapshot.finished = finished;
+
+				int previous = shared.exchange(back | fresh_bit, std::memory_order_acq_rel);
+				back = previous & index_mask;
+			}
+
+			void renderLoop() {
+				uint64_t renderedVersion = 0;
+				bool finished = false;
+
+				while (true) {
+					point3 position, lookAt;
+					double vfov;
+					uint64_t version;
+
+					{
+						std::unique_lock<std::mutex> lock(controlLock);
+						// Nothing to do before the first setCamera, or once finished until the camera moves
+						wake.wait(lock, [&]() { return stopping || (cameraVersion != 0 && (!finished || cameraVersion != renderedVersion)); });
+						if (stopping) return;
+
+						position = cameraPosition;
+						lookAt = cameraLookAt;
+						vfov = cameraVfov;
+						version = cameraVersion;
+					}
+
+					if (version != renderedVersion) {
+						resetAccumulation();
+						renderedVersion = version;
+						finished = false;
+					}
+
+					if (beforePass) beforePass();
+
+					// The waiting render thread helps the workers, so a pass has one thread more than the pool
+					int threads = threadLimit > 0 ? threadLimit : thread_pool::global().size() + 1;
+					std::vector<chunk_work> work = scheduler.plan(accumulation, renderChunk, numberOfChunks, threads, adaptive);
+					if (work.empty()) {
+						// Every remaining chunk is at the sample limit
+						std::fill(renderChunk, renderChunk + numberOfChunks, false);
+					}
+
+					render_pass pass;
+					{
+						std::lock_guard<std::mutex> lock(controlLock);
+						if (stopping || cameraVersion != version) continue;
+
+						pass = renderWorldImageMCRT_ChunkWiseAsync(accumulation, width, height, std::move(work), chunkSize, world, maxDepth, position, lookAt, vfov, threadLimit, &adaptive, integrator);
+						currentPass = pass;
+					}
+
+					pass.wait();
+
+					{
+						std::lock_guard<std::mutex> lock(controlLock);
+						currentPass = render_pass();
+					}
+
+					// A cancelled pass left some chunks a sample behind, the next pass starts over or the session is stopping anyway
+					if (pass.is_cancelled()) continue;
+
+					passCount++;
+
+					updateChunksToRender(renderChunk, accumulation, numberOfChunks);
+
+					finished = std::none_of(renderChunk, renderChunk + numberOfChunks, [](bool render) { return render; });
+
+					publish(version, pass.elapsed_ms(), finished);
+
+					if (finished) Tracelog::Debug("Render finished after %d passes", passCount);
+				}
+			}
+
+			const hittable& world;
+			int width, height, chunkSize, maxDepth;
+			int threadLimit;
+			adaptive_settings adaptive;
+
+			int chunksWide, chunksTall, numberOfChunks;
+
+			// Render thread only
+			PixelChunkData_t* accumulation;
+			bool* renderChunk;
+			int passCount = 0;
+			int back = 0;
+
+			// Triple buffer: back is written by the render thread, front is read by the UI, shared holds the middle index and a fresh bit
+			RenderSnapshot snapshots[3];
+			std::atomic<int> shared = 1;
+			int front = 2;
+
+			// Guarded by controlLock
+			std::mutex controlLock;
+			std::condition_variable wake;
+			point3 cameraPosition;
+			point3 cameraLookAt;
+			double cameraVfov = 20.0;
+			uint64_t cameraVersion = 0;
+			bool stopping = false;
+			render_pass currentPass;
+
+			std::thread renderThread;
+		};
+
+	}
+}
+
+#endif // !RENDER_SESSION_H
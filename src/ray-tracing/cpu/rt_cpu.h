@@ -1,10 +1,18 @@
+#pragma once
+
 #include "rtweekend.h"
 
 #include "color.h"
 #include "hittable_list.h"
+#include "bvh.h"
+#include "instance.h"
 #include "sphere.h"
 #include "camera.h"
 #include "material.h"
+#include "thread_pool.h"
+#include "post_process.h"
+#include "path_tracing.h"
+#include "wavefront.h"
 
 #include <iostream>
 #include <thread>
@@ -12,7 +20,11 @@
 #include <future>
 #include <chrono>
 #include <mutex>
+#include <vector>
+#include <cstring>
+#include <new>
 #include <cmath>
+#include <algorithm>
 
 #define TRUE 1
 #define FALSE 0
@@ -21,24 +33,46 @@ namespace RAYTRACING {
 
 	namespace CPU {
 
-		color ray_color(const ray& r, const hittable& world, int depth) {
-			hit_record rec;
-
-			// If we've exceed the ray bounce limit, no more light is gathered
-			if (depth <= 0) {
-				return color(0, 0, 0);
-			}
+		/**
+		 * Trace a path of at most depth rays whose first ray was already intersected, such as a camera ray traced in a packet.
+		 * @param hit Whether r hit anything
+		 * @param rec Closest hit of r if it did
+		*/
+		color ray_color(const ray& r, bool hit, hit_record rec, const hittable& world, int depth, sampler& rng) {
+			path_state path(r);
+
+			while (path.bounces < depth) {
+				if (path.bounces > 0) hit = world.hit(path.r, 0.001, infinity, rec);
+				if (!hit) {
+					path.radiance += path.throughput * sky_color(path.r);
+					break;
+				}
 
-			if (world.hit(r, 0.001, infinity, rec)) {
 				ray scattered;
 				color attenuation;
-				if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-					return attenuation * ray_color(scattered, world, depth - 1);
-				return color(0, 0, 0);
+				if (!scatter_hit(path.r, rec, attenuation, scattered, rng)) break;
+
+				path.throughput = path.throughput * attenuation;
+				path.r = scattered;
+				path.bounces++;
+
+				if (!continue_path(path.throughput, path.bounces, rng)) break;
 			}
-			vec3 unit_direction = unit_vector(r.direction());
-			auto t = 0.5 * (unit_direction.y() + 1.0);
-			return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+
+			return path.radiance;
+		}
+
+		/**
+		 * Trace a path of at most depth rays, Russian roulette ends dim paths early (see continue_path).
+		*/
+		color ray_color(const ray& r, const hittable& world, int depth, sampler& rng) {
+			hit_record rec;
+			bool hit = depth > 0 && world.hit(r, 0.001, infinity, rec);
+			return ray_color(r, hit, rec, world, depth, rng);
+		}
+
+		color ray_color(const ray& r, const hittable& world, int depth) {
+			return ray_color(r, world, depth, thread_sampler());
 		}
 
 		/**
@@ -66,16 +100,17 @@ namespace RAYTRACING {
 
 		/**
 		 * A random scene with lots of small spheres and three distinct large spheres
+		 * @param extent Half width of the grid of small spheres, there are (2 * extent)^2 of them
 		*/
-		hittable_list random_scene() {
+		hittable_list random_scene(int extent = 11) {
 			hittable_list world;
 
 			auto material_ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
 			world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, material_ground));
 
 			// Random spheres
-			for (int a = -11; a < 11; a++) {
-				for (int b = -11; b < 11; b++) {
+			for (int a = -extent; a < extent; a++) {
+				for (int b = -extent; b < extent; b++) {
 					auto choose_mat = random_double();
 					point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
 
@@ -121,97 +156,146 @@ namespace RAYTRACING {
 		}
 
 		/**
-		 *
+		 * Grid of copies of one small sphere cluster, placed through instances of a single shared bvh.
+		 * Memory grows with the number of instances, not with the number of spheres they show.
+		 * @param extent Grid extent, (2 * extent)^2 clusters
+		 * @param cluster_size Spheres per cluster
 		*/
-		unsigned char* colors_to_byte_array(color* pixels, int length, int samples_per_pixel) {
-			unsigned char* byte_array = (unsigned char*)malloc(3 * length);
-
-			for (int i = 0; i < length; i++) {
-				int byte_index = 3 * i;
-				pixels[i] = correct_color_and_gamma(pixels[i], samples_per_pixel);
-				byte_array[byte_index] = static_cast<unsigned char>(256 * clamp(pixels[i].x(), 0.0, 0.999));
-				byte_array[byte_index + 1] = static_cast<unsigned char>(256 * clamp(pixels[i].y(), 0.0, 0.999));
-				byte_array[byte_index + 2] = static_cast<unsigned char>(256 * clamp(pixels[i].z(), 0.0, 0.999));
+		hittable_list instanced_scene(int extent = 11, int cluster_size = 16) {
+			hittable_list world;
+
+			auto material_ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+			world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, material_ground));
+
+			// Cluster in object space, inside the unit cell around the origin
+			hittable_list cluster;
+			for (int i = 0; i < cluster_size; i++) {
+				double radius = random_double(0.04, 0.1);
+				point3 center(random_double(-0.4, 0.4), radius + random_double(0, 0.3), random_double(-0.4, 0.4));
+				cluster.add(make_shared<sphere>(center, radius, make_shared<lambertian>(color::random() * color::random())));
+			}
+			auto cluster_bvh = make_shared<bvh>(cluster, bvh_build_method::sah_sweep);
+
+			for (int a = -extent; a < extent; a++) {
+				for (int b = -extent; b < extent; b++) {
+					transform placement = transform::translate(vec3(a + 0.5, 0, b + 0.5)) * transform::rotate_y(random_double(0, 360));
+
+					// Most copies keep the cluster materials, some are turned into metal or glass as a whole
+					shared_ptr<material> override_material;
+					auto choose_mat = random_double();
+					if (choose_mat > 0.95) override_material = make_shared<dielectric>(1.5);
+					else if (choose_mat > 0.8) override_material = make_shared<metal>(color::random(0.5, 1), random_double(0, 0.5));
+
+					world.add(make_shared<instance>(cluster_bvh, placement, override_material));
+				}
 			}
 
-			return byte_array;
+			auto mat_1 = make_shared<dielectric>(1.5);
+			world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, mat_1));
+
+			auto mat_2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+			world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, mat_2));
+
+			auto mat_3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+			world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, mat_3));
+
+			return world;
 		}
 
 		/**
-		 * Multi core renderer
+		 * Convert a row major image to RGB bytes. The pixels are left untouched.
+		 * Rows are converted at their image position, so the dither keeps its 4x4 pattern.
+		 * @param byte_array Caller owned, at least 3 * width * height bytes
 		*/
-		void render_world_mt(hittable_list& world, camera cam, int image_width, int image_height, int samples_per_pixel, int max_depth, color* rawPixelColors, bool progressiveRender) {
-			int cores = std::thread::hardware_concurrency();
-			// volatile std::atomic<std::size_t> count(0);
-
-
-			int count = 0;
-			std::vector<std::future<void>> future_vector;
-			int blockSize = 1;
-			std::mutex checkoutIndexLock;
-
-			int max = image_width * image_height;
-			// printf("Max Pixels: %lld\n", max);
-			while (cores--) {
-				future_vector.emplace_back(
-					std::async([=, &world, &count, &rawPixelColors, &image_width, &image_height, &progressiveRender, &checkoutIndexLock, &blockSize]()
-						{
-							while (true)
-							{
-								checkoutIndexLock.lock();
-								if (count >= max) {
-
-									checkoutIndexLock.unlock();
-									break;
-								}
-								int indexStart = count;
-								int blockToDo = (int)std::min(blockSize, max - indexStart);
-								count += blockToDo;
-								checkoutIndexLock.unlock();
-
-
-								// std::size_t index = count++;
-								// if (index >= max)
-								// 	break;
-								for (int i = 0; i < blockToDo; i++) {
-									int index = indexStart + i;
-									int x = index % image_width;
-									int y = index / image_width;
-									color pixel_color(0, 0, 0);
-									for (int s = 0; s < samples_per_pixel; ++s) {
-										auto u = (x + random_double()) / (image_width - 1);
-										auto v = (y + random_double()) / (image_height - 1);
-										ray r = cam.get_ray(u, v);
-										pixel_color += ray_color(r, world, max_depth);
-									}
-									if (progressiveRender) {
-										rawPixelColors[y * image_width + x] += pixel_color;
-									}
-									else {
-										rawPixelColors[y * image_width + x] = pixel_color;
-									}
-								}
-							}
-						}
-					)
-				);
-			}
-			using namespace std::chrono;
-			using namespace std::this_thread;
+		void colors_to_byte_array(const color* pixels, int width, int height, int samples_per_pixel, unsigned char* byte_array, const post_settings& settings = post_settings()) {
+			post_process_image(pixels, width, height, samples_per_pixel, settings, byte_array, 3);
+		}
 
-			while (!(count >= max)) {
-				// Wait
-				// sleep_for(nanoseconds(1));
-				sleep_until(system_clock::now() + milliseconds(2));
-			}
+		/**
+		 * Handle to a render pass running on the thread pool. The caller can poll it or wait on it,
+		 * the buffers and the world passed to the pass must stay alive until it is done.
+		*/
+		class render_pass {
+		public:
+			render_pass() {}
+			render_pass(std::shared_ptr<parallel_job> pass_job, int work_items) : job(pass_job), items(work_items) {}
+
+			bool valid() const { return job != nullptr; }
+			bool is_done() const { return job == nullptr || job->is_done(); }
+
+			/**
+			 * Block until the pass is done, the calling thread helps with the work meanwhile.
+			*/
+			void wait() { if (job) job->wait(); }
+
+			/**
+			 * @return true if the pass finished within the timeout
+			*/
+			bool wait_for(std::chrono::milliseconds timeout) { return job == nullptr || job->wait_for(timeout); }
+
+			/**
+			 * Skip the work items that have not started yet. Wait on the pass before reusing its buffers.
+			*/
+			void cancel() { if (job) job->cancel(); }
+
+			bool is_cancelled() const { return job != nullptr && job->is_cancelled(); }
+
+			/**
+			 * Duration of the pass, measured up to now while it is still running.
+			*/
+			double elapsed_ms() const { return job ? job->elapsed_ms() : 0.0; }
+
+			/**
+			 * Number of rows or chunks in the pass.
+			*/
+			int item_count() const { return items; }
+
+		private:
+			std::shared_ptr<parallel_job> job;
+			int items = 0;
+		};
 
-			//return rawPixelColors;
+		/**
+		 * Start a multi core render of the whole image, one row per work item.
+		*/
+		render_pass render_world_mt_async(const hittable& world, camera cam, int image_width, int image_height, int samples_per_pixel, int max_depth, color* rawPixelColors, bool progressiveRender) {
+			// Every row gets its own generator, so workers share no random state
+			const uint64_t seed = thread_sampler().next_u64();
+
+			auto job = thread_pool::global().parallel_for_async(image_height, [=, &world](int y) {
+				sampler rng(seed, y);
+
+				for (int x = 0; x < image_width; x++) {
+					color pixel_color(0, 0, 0);
+					for (int s = 0; s < samples_per_pixel; ++s) {
+						auto u = (x + rng.next_double()) / (image_width - 1);
+						auto v = (y + rng.next_double()) / (image_height - 1);
+						ray r = cam.get_ray(u, v, rng);
+						pixel_color += ray_color(r, world, max_depth, rng);
+					}
+					if (progressiveRender) {
+						rawPixelColors[y * image_width + x] += pixel_color;
+					}
+					else {
+						rawPixelColors[y * image_width + x] = pixel_color;
+					}
+				}
+			});
+
+			return render_pass(job, image_height);
+		}
+
+		/**
+		 * Multi core renderer
+		*/
+		void render_world_mt(const hittable& world, camera cam, int image_width, int image_height, int samples_per_pixel, int max_depth, color* rawPixelColors, bool progressiveRender) {
+			render_world_mt_async(world, cam, image_width, image_height, samples_per_pixel, max_depth, rawPixelColors, progressiveRender).wait();
 		}
 
 		/**
 		 * Render an image from a predefined world.
 		*/
-		void renderWorldImageMCRT(color* pixel_output, int image_width, int image_height, hittable_list& world, int samples_per_pixel, int max_depth, point3 camera_pos, point3 camera_looking_at, double vfov, bool progressiveRender) {
+		void renderWorldImageMCRT(color* pixel_output, int image_width, int image_height, const hittable& world, int samples_per_pixel, int max_depth, point3 camera_pos, point3 camera_looking_at, double vfov, bool progressiveRender) {
 			const double aspect_ratio = (double)image_width / (double)image_height;
 			// const double aspect_ratio = 16.0 / 9.0;
 
@@ -227,20 +311,148 @@ namespace RAYTRACING {
 			render_world_mt(world, cam, image_width, image_height, samples_per_pixel, max_depth, pixel_output, progressiveRender);
 		}
 
-		struct PixelChunkData_t
+		/**
+		 * How a progressive render decides that it has enough samples.
+		*/
+		enum class convergence_policy {
+			pixel_variance,	// Per pixel: standard error of the mean luminance relative to the luminance, see PixelChunkData_t::pixel_error
+			half_buffer		// Per chunk: difference between the images of the odd and the even samples, see PixelChunkData_t::half_buffer_error
+		};
+
+		/**
+		 * When a pixel or chunk of a progressive render has enough samples.
+		*/
+		struct adaptive_settings {
+			convergence_policy policy = convergence_policy::pixel_variance;
+			double threshold = 0.01;	// Error at which sampling stops, measured as the policy defines it
+			double dark_floor = 0.05;	// Added to the luminance before comparing, so near black pixels stop on absolute error
+			int min_samples = 16;		// Before this the variance estimate is too unreliable to stop on
+			int max_samples = 250;
+		};
+
+		/**
+		 * Running mean and sum of squared differences of a pixel's sample luminance (Welford).
+		*/
+		struct pixel_statistics {
+			float mean;
+			float m2;
+		};
+
+		/**
+		 * One chunk of a progressive image. Build allocates all headers and pixels of an image as one 64 byte aligned block:
+		 * the headers come first, padded to whole cache lines so workers finishing neighbouring chunks do not share lines,
+		 * followed by the data of every chunk, each chunk starting on a new line.
+		 * A chunk's data is one run of data_bytes: the color sums, the per pixel sample counts, the luminance statistics
+		 * and the sums of every second sample.
+		*/
+		struct alignas(64) PixelChunkData_t
 		{
 			int width;
 			int height;
-			color* pixel_data;
-			int number_of_samples;
+			color* pixel_data; // Sum of the samples of every pixel
+			int number_of_samples; // Passes that sampled this chunk, pixels that stopped early have fewer samples
 			int number_of_pixels;
+			uint64_t epoch; // Bumped whenever the pixels change, copyChangedChunks skips chunks whose epochs match
+			int* sample_counts;
+			pixel_statistics* luminance_stats;
+			color* half_data; // Sum of the even numbered samples of every pixel, the odd ones are pixel_data - half_data
+			int data_bytes;
+			int active_pixels; // Pixels that had not converged after the last pass
+			float noise; // Mean pixel_error of those pixels, set by the worker that rendered the pass
+			float sample_ms; // Time the last pass took for one sample of every active pixel, 0 before the first
+
+			static constexpr size_t alignment = 64;
+
+			/**
+			 * Add one sample to a pixel.
+			*/
+			void add_sample(int index, const color& sample) {
+				pixel_data[index] += sample;
+				int n = ++sample_counts[index];
+				if ((n & 1) == 0) half_data[index] += sample;
+
+				float value = (float)luminance(sample);
+				pixel_statistics& stats = luminance_stats[index];
+				float delta = value - stats.mean;
+				stats.mean += delta / n;
+				stats.m2 += delta * (value - stats.mean);
+			}
+
+			/**
+			 * Standard error of the pixel's mean luminance relative to that luminance. Infinite before the second sample.
+			*/
+			double pixel_error(int index, const adaptive_settings& adaptive) const {
+				int n = sample_counts[index];
+				if (n < 2) return std::numeric_limits<double>::infinity();
+
+				const pixel_statistics& stats = luminance_stats[index];
+				return std::sqrt(stats.m2 / ((double)(n - 1) * n)) / (stats.mean + adaptive.dark_floor);
+			}
+
+			/**
+			 * True once the pixel's mean is known well enough, or it hit the sample limit.
+			*/
+			bool pixel_converged(int index, const adaptive_settings& adaptive) const {
+				int n = sample_counts[index];
+				if (n >= adaptive.max_samples) return true;
+				if (n < adaptive.min_samples) return false;
+				return pixel_error(index, adaptive) <= adaptive.threshold;
+			}
+
+			/**
+			 * Mean difference between the images made of the odd and of the even samples, two independent estimates of the same image.
+			 * Each pixel's difference is divided by the square root of its luminance, so an error weighs more in dark regions as it does
+			 * for the eye. Unlike a comparison with the neighbours this does not mistake edges and texture for noise.
+			 * Infinite until every pixel has two samples.
+			*/
+			double half_buffer_error(const adaptive_settings& adaptive) const {
+				double sum = 0;
+				for (int j = 0; j < number_of_pixels; j++) {
+					int n = sample_counts[j];
+					if (n < 2) return std::numeric_limits<double>::infinity();
+
+					int even = n / 2;
+					int odd = n - even;
+					color even_mean = half_data[j] / even;
+					color odd_mean = (pixel_data[j] - half_data[j]) / odd;
+
+					double difference = std::fabs(even_mean.x() - odd_mean.x()) + std::fabs(even_mean.y() - odd_mean.y()) + std::fabs(even_mean.z() - odd_mean.z());
+					sum += difference / std::sqrt(luminance(pixel_data[j] / n) + adaptive.dark_floor);
+				}
+				return sum / number_of_pixels;
+			}
+
+			/**
+			 * Forget all samples.
+			*/
+			void clear() {
+				std::memset((void*)pixel_data, 0, data_bytes);
+				number_of_samples = 0;
+				active_pixels = number_of_pixels;
+				noise = std::numeric_limits<float>::infinity();
+				sample_ms = 0;
+				epoch++;
+			}
 
 			static PixelChunkData_t* Build(int width, int height, int chunk_size) {
 				int chunks_wide = std::ceil(width / (float)chunk_size);
 				int chunks_tall = std::ceil(height / (float)chunk_size);
 				int number_of_chunks = chunks_wide * chunks_tall;
 
-				PixelChunkData_t* data = (PixelChunkData_t*)malloc(sizeof(PixelChunkData_t) * number_of_chunks);
+				auto aligned = [](size_t bytes) { return (bytes + alignment - 1) & ~(alignment - 1); };
+				auto chunk_bytes = [&](int pixels) { return 2 * aligned(sizeof(color) * pixels) + aligned(sizeof(int) * pixels) + aligned(sizeof(pixel_statistics) * pixels); };
+
+				// Sizes first, so the whole image is a single allocation
+				size_t total_bytes = sizeof(PixelChunkData_t) * number_of_chunks;
+				for (int i = 0; i < number_of_chunks; i++) {
+					int cx = i % chunks_wide;
+					int cy = i / chunks_wide;
+					total_bytes += chunk_bytes((std::min(width, (cx + 1) * chunk_size) - cx * chunk_size) * (std::min(height, (cy + 1) * chunk_size) - cy * chunk_size));
+				}
+
+				char* block = (char*)::operator new(total_bytes, std::align_val_t(alignment));
+				PixelChunkData_t* data = (PixelChunkData_t*)block;
+				char* next = block + sizeof(PixelChunkData_t) * number_of_chunks;
 
 				for (int i = 0; i < number_of_chunks; i++) {
 					int cx = i % chunks_wide;
@@ -254,138 +466,253 @@ namespace RAYTRACING {
 
 					int chunk_width = end_x - start_x;
 					int chunk_height = end_y - start_y;
+					int pixels = chunk_width * chunk_height;
 
+					new (&data[i]) PixelChunkData_t();
 					data[i].width = chunk_width;
 					data[i].height = chunk_height;
-					data[i].number_of_samples = 0;
-
-					data[i].number_of_pixels = chunk_width * chunk_height;
+					data[i].number_of_pixels = pixels;
+					data[i].epoch = 0;
 
-					data[i].pixel_data = (color*)malloc(sizeof(color) * data[i].number_of_pixels);
+					data[i].pixel_data = (color*)next;
+					data[i].sample_counts = (int*)(next + aligned(sizeof(color) * pixels));
+					data[i].luminance_stats = (pixel_statistics*)((char*)data[i].sample_counts + aligned(sizeof(int) * pixels));
+					data[i].half_data = (color*)((char*)data[i].luminance_stats + aligned(sizeof(pixel_statistics) * pixels));
+					data[i].data_bytes = (int)chunk_bytes(pixels);
+					next += data[i].data_bytes;
 
-					for (int j = 0; j < data[i].number_of_pixels; j++) {
-						data[i].pixel_data[j] = color(0, 0, 0);
-					}
+					data[i].clear();
 				}
 
 				return data;
 			}
 
 			static void Free(PixelChunkData_t* data, int width, int height, int chunk_size) {
-				int chunks_wide = std::ceil(width / (float)chunk_size);
-				int chunks_tall = std::ceil(height / (float)chunk_size);
-				int number_of_chunks = chunks_wide * chunks_tall;
+				(void)width; (void)height; (void)chunk_size; // One block, kept for symmetry with Build
+				::operator delete((void*)data, std::align_val_t(alignment));
+			}
+		};
 
-				for (int i = 0; i < number_of_chunks; i++) {
-					free(data[i].pixel_data);
-				}
+		static_assert(sizeof(PixelChunkData_t) % PixelChunkData_t::alignment == 0, "chunk headers must fill whole cache lines");
 
-				free(data);
-			}
+		/**
+		 * Samples a render pass takes in one chunk.
+		*/
+		struct chunk_work {
+			int chunk;
+			int samples;
 		};
 
 		/**
-		 * Multi core chunk based renderer. This is a progressive single sample renderer.
+		 * How the chunk renderers trace their samples.
 		*/
-		void render_world_mt_chunk(hittable_list& world, camera cam, int image_width, int image_height, bool* render_chunk, int chunk_size, int max_depth, PixelChunkData_t* output, int thread_limit = -1) {
-			const int chunks_wide = std::ceil(image_width / (float)chunk_size);
-			const int chunks_tall = std::ceil(image_height / (float)chunk_size);
-			const int numberOfChunks = chunks_wide * chunks_tall;
-			const int samples_per_pixel = 1;
+		enum class integrator_mode {
+			path,      // Every sample runs its whole path with ray_color
+			wavefront  // All samples of a chunk in a pass are traced together by a wavefront_tracer
+		};
 
-			std::vector<int> chunkRenderIndexes;
-			for (int i = 0; i < numberOfChunks; i++) {
-				if (render_chunk[i]) {
-					chunkRenderIndexes.push_back(i);
+		/**
+		 * Trace samples passes over a chunk with the calling thread's wavefront_tracer.
+		 * @param adaptive Pixels that converged by these settings get no rays, nullptr traces every pixel
+		 * @return Radiance of sample s of pixel index at [s * number_of_pixels + index], valid until the thread traces the next chunk
+		*/
+		const color* traceChunkWavefront(const hittable& world, const camera& cam, int image_width, int image_height, const PixelChunkData_t& chunk, int start_x, int start_y, int samples, int max_depth,
+			const adaptive_settings* adaptive, sampler& rng) {
+
+			thread_local std::vector<color> radiance;
+			radiance.assign((size_t)samples * chunk.number_of_pixels, color(0, 0, 0));
+
+			wavefront_tracer& tracer = thread_wavefront_tracer();
+			ray_stream& camera_rays = tracer.begin_batch();
+			camera_rays.reserve(samples * chunk.number_of_pixels);
+
+			// Generate: tile by tile within a sample, so the first bounce can trace the camera rays in coherent packets
+			for (int s = 0; s < samples; s++) {
+				for (int tile_y = 0; tile_y < chunk.height; tile_y += ray_packet_width) {
+					for (int tile_x = 0; tile_x < chunk.width; tile_x += ray_packet_width) {
+						for (int y = tile_y; y < std::min(tile_y + ray_packet_width, chunk.height); y++) {
+							for (int x = tile_x; x < std::min(tile_x + ray_packet_width, chunk.width); x++) {
+								const int index = y * chunk.width + x;
+								if (adaptive && chunk.pixel_converged(index, *adaptive)) continue;
+
+								auto u = (start_x + x + rng.next_double()) / (image_width - 1);
+								auto v = (start_y + y + rng.next_double()) / (image_height - 1);
+								camera_rays.push(cam.get_ray(u, v, rng), color(1, 1, 1), s * chunk.number_of_pixels + index);
+							}
+						}
+					}
 				}
 			}
 
-			const int max = chunkRenderIndexes.size();
-
-			int cores = (int)std::thread::hardware_concurrency();
+			tracer.trace(world, max_depth, rng, radiance.data());
+			return radiance.data();
+		}
 
-			if (thread_limit != -1 && thread_limit > 0) {
-				cores = std::min(cores, thread_limit);
-			}
+		/**
+		 * Start a multi core chunk based render pass. Every listed chunk gets the given number of samples per pixel,
+		 * chunks are handed to the workers in list order. output is written until the pass is done.
+		 * The worker that finishes a chunk also updates its active_pixels, noise and sample_ms, so no pass over the image is needed afterwards.
+		 * @param adaptive Skip pixels that converged by these settings and stop a chunk early once it converged, nullptr samples every pixel
+		 * @param integrator With wavefront the samples of pixels that converge or chunks that stop partway through the pass are traced anyway and dropped
+		*/
+		render_pass render_world_mt_chunk_async(const hittable& world, camera cam, int image_width, int image_height, std::vector<chunk_work> work, int chunk_size, int max_depth, PixelChunkData_t* output, int thread_limit = -1, const adaptive_settings* adaptive = nullptr,
+			integrator_mode integrator = integrator_mode::path) {
+			const int chunks_wide = std::ceil(image_width / (float)chunk_size);
 
-			const int cores_total = cores;
-			int chunkRenderIndex = 0;
-			std::vector<std::future<void>> future_vector;
+			auto chunkWork = std::make_shared<std::vector<chunk_work>>(std::move(work));
 
-			std::mutex checkoutIndexLock;
+			// Every chunk gets its own generator, so workers share no random state
+			const uint64_t seed = thread_sampler().next_u64();
 
-			std::atomic<int> exited = 0;
+			const adaptive_settings stopping = adaptive ? *adaptive : adaptive_settings();
+			const bool per_pixel = adaptive && stopping.policy == convergence_policy::pixel_variance;
+			const bool per_chunk = adaptive && stopping.policy == convergence_policy::half_buffer;
 
-			while (cores-- > 0)
-				future_vector.emplace_back(
-					std::async(
-						[=, &output, &chunkRenderIndex, &chunkRenderIndexes, &exited, &image_width, &image_height, &chunks_wide, &chunks_tall, &checkoutIndexLock, &chunk_size, &max]()
+			auto job = thread_pool::global().parallel_for_async((int)chunkWork->size(), [=, &world](int i) {
+				const int chunkIndex = (*chunkWork)[i].chunk;
+				const int samples = (*chunkWork)[i].samples;
 
-						{
-							while (true)
-							{
-								checkoutIndexLock.lock();
-								if (chunkRenderIndex >= max) {
+				int cx = chunkIndex % chunks_wide;
+				int cy = chunkIndex / chunks_wide;
 
-									exited++;
+				int start_y = cy * chunk_size;
 
-									checkoutIndexLock.unlock();
-									break;
-								}
-								int chunkIndex = chunkRenderIndexes[chunkRenderIndex];
-								chunkRenderIndex++; // Checkout exactly one chunk to render
-								checkoutIndexLock.unlock();
+				int start_x = cx * chunk_size;
 
-								// Do block render
+				int end_x = start_x + output[chunkIndex].width;
+				int end_y = start_y + output[chunkIndex].height;
 
-								int cx = chunkIndex % chunks_wide;
-								int cy = chunkIndex / chunks_wide;
+				PixelChunkData_t& chunk = output[chunkIndex];
+				sampler rng(seed, chunkIndex);
 
-								int start_y = cy * chunk_size;
+				auto start = std::chrono::steady_clock::now();
+				int sweeps = 0;
 
-								int start_x = cx * chunk_size;
+				// Sample s of pixel index ends up in traced[s * number_of_pixels + index]
+				const color* traced = nullptr;
+				if (integrator == integrator_mode::wavefront) {
+					traced = traceChunkWavefront(world, cam, image_width, image_height, chunk, start_x, start_y, samples, max_depth, per_pixel ? &stopping : nullptr, rng);
+				}
 
-								int end_x = start_x + output[chunkIndex].width;
-								int end_y = start_y + output[chunkIndex].height;
+				// Camera rays of a tile, traced as one packet
+				ray rays[ray_packet_size];
+				hit_record recs[ray_packet_size];
+				bool hits[ray_packet_size];
+				int indices[ray_packet_size];
+
+				while (sweeps < samples) {
+					int active = 0;
+					double error_sum = 0;
+
+					// The pixel's statistics are hot in cache right after its sample, so this is where the chunk's estimate is cheapest
+					auto update_estimate = [&](int index) {
+						if (per_pixel && !chunk.pixel_converged(index, stopping)) {
+							active++;
+							error_sum += chunk.pixel_error(index, stopping);
+						}
+					};
 
-								int index = 0;
-								for (int y = start_y; y < end_y; y++) {
-									for (int x = start_x; x < end_x; x++) {
-										color pixel_color(0, 0, 0);
+					if (traced) {
+						int index = 0;
+						for (int y = start_y; y < end_y; y++) {
+							for (int x = start_x; x < end_x; x++, index++) {
+								// Pixels that converged are done, the rest of the chunk keeps sampling
+								if (per_pixel && chunk.pixel_converged(index, stopping)) continue;
 
-										for (int s = 0; s < samples_per_pixel; ++s) {
-											auto u = (x + random_double()) / (image_width - 1);
-											auto v = (y + random_double()) / (image_height - 1);
-											ray r = cam.get_ray(u, v);
-											pixel_color += ray_color(r, world, max_depth);
-										}
-										//output[y * image_width + x] += pixel_color;
-										output[chunkIndex].pixel_data[index] += pixel_color;
-										index++;
+								chunk.add_sample(index, traced[sweeps * chunk.number_of_pixels + index]);
+								update_estimate(index);
+							}
+						}
+					}
+					else {
+						// Tile by tile: the camera rays of a tile share their bvh node tests, later bounces go one ray at a time
+						for (int tile_y = start_y; tile_y < end_y; tile_y += ray_packet_width) {
+							for (int tile_x = start_x; tile_x < end_x; tile_x += ray_packet_width) {
+								int count = 0;
+								for (int y = tile_y; y < std::min(tile_y + ray_packet_width, end_y); y++) {
+									for (int x = tile_x; x < std::min(tile_x + ray_packet_width, end_x); x++) {
+										const int index = (y - start_y) * chunk.width + (x - start_x);
+										if (per_pixel && chunk.pixel_converged(index, stopping)) continue;
+
+										auto u = (x + rng.next_double()) / (image_width - 1);
+										auto v = (y + rng.next_double()) / (image_height - 1);
+										rays[count] = cam.get_ray(u, v, rng);
+										indices[count++] = index;
 									}
 								}
-								output[chunkIndex].number_of_samples++;
+
+								if (count == 0) continue;
+								if (max_depth > 0) world.hit_packet(rays, count, 0.001, infinity, recs, hits);
+
+								for (int k = 0; k < count; k++) {
+									chunk.add_sample(indices[k], ray_color(rays[k], max_depth > 0 && hits[k], recs[k], world, max_depth, rng));
+									update_estimate(indices[k]);
+								}
 							}
 						}
-					)
-				);
+					}
+
+					chunk.number_of_samples++;
+					sweeps++;
+
+					if (per_pixel) {
+						chunk.active_pixels = active;
+						chunk.noise = active > 0 ? (float)(error_sum / active) : 0.0f;
+					}
+					else if (per_chunk) {
+						// Every pixel of the chunk has the same sample count, so the chunk stops as a whole
+						double error = chunk.half_buffer_error(stopping);
+						bool done = chunk.number_of_samples >= stopping.max_samples || (chunk.number_of_samples >= stopping.min_samples && error <= stopping.threshold);
+						chunk.active_pixels = done ? 0 : chunk.number_of_pixels;
+						chunk.noise = (float)error;
+					}
+					else {
+						chunk.active_pixels = chunk.number_of_pixels;
+						chunk.noise = std::numeric_limits<float>::infinity();
+					}
+
+					if (chunk.active_pixels == 0) break;
+				}
 
-			using namespace std::chrono;
-			using namespace std::this_thread;
+				// A work item without samples leaves the previous estimate rather than dividing by zero
+				if (sweeps > 0) chunk.sample_ms = (float)(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / sweeps);
+				chunk.epoch++;
+			}, thread_limit);
 
-			// int prevCount, prevCount2 = 0;
+			return render_pass(job, (int)chunkWork->size());
+		}
 
-			while (!(exited == cores_total)) {
-				// Wait
-				sleep_until(system_clock::now() + nanoseconds(75000000));
+		/**
+		 * Start a multi core chunk based render pass, one sample per pixel of every chunk flagged in render_chunk.
+		 * render_chunk is read before this returns.
+		*/
+		render_pass render_world_mt_chunk_async(const hittable& world, camera cam, int image_width, int image_height, bool* render_chunk, int chunk_size, int max_depth, PixelChunkData_t* output, int thread_limit = -1, const adaptive_settings* adaptive = nullptr) {
+			const int chunks_wide = std::ceil(image_width / (float)chunk_size);
+			const int chunks_tall = std::ceil(image_height / (float)chunk_size);
+			const int numberOfChunks = chunks_wide * chunks_tall;
+
+			std::vector<chunk_work> work;
+			for (int i = 0; i < numberOfChunks; i++) {
+				if (render_chunk[i]) {
+					work.push_back({ i, 1 });
+				}
 			}
 
+			return render_world_mt_chunk_async(world, cam, image_width, image_height, std::move(work), chunk_size, max_depth, output, thread_limit, adaptive);
 		}
 
 		/**
-		* Progressively render an image in chunks from a predefined world.
+		 * Multi core chunk based renderer. This is a progressive single sample renderer.
 		*/
-		void renderWorldImageMCRT_ChunkWise(PixelChunkData_t* pixel_output, int image_width, int image_height, bool* render_chunk, int chunk_size, hittable_list& world, int max_depth, point3 camera_pos, point3 camera_looking_at, double vfov, int thread_limit = -1) {
+		void render_world_mt_chunk(const hittable& world, camera cam, int image_width, int image_height, bool* render_chunk, int chunk_size, int max_depth, PixelChunkData_t* output, int thread_limit = -1, const adaptive_settings* adaptive = nullptr) {
+			render_world_mt_chunk_async(world, cam, image_width, image_height, render_chunk, chunk_size, max_depth, output, thread_limit, adaptive).wait();
+		}
+
+		/**
+		* Start a progressive chunk render pass of a predefined world with the samples of every chunk given by work, see render_world_mt_chunk_async.
+		*/
+		render_pass renderWorldImageMCRT_ChunkWiseAsync(PixelChunkData_t* pixel_output, int image_width, int image_height, std::vector<chunk_work> work, int chunk_size, const hittable& world, int max_depth, point3 camera_pos, point3 camera_looking_at, double vfov, int thread_limit = -1, const adaptive_settings* adaptive = nullptr,
+			integrator_mode integrator = integrator_mode::path) {
 
 			const double aspect_ratio = (double)image_width / (double)image_height;
 
@@ -397,12 +724,33 @@ namespace RAYTRACING {
 			auto aperture = 0.0;
 			camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
 
-			render_world_mt_chunk(world, cam, image_width, image_height, render_chunk, chunk_size, max_depth, pixel_output, thread_limit);
+			return render_world_mt_chunk_async(world, cam, image_width, image_height, std::move(work), chunk_size, max_depth, pixel_output, thread_limit, adaptive, integrator);
+		}
+
+		/**
+		* Start a progressive chunk render pass of a predefined world, one sample per pixel of every chunk flagged in render_chunk.
+		*/
+		render_pass renderWorldImageMCRT_ChunkWiseAsync(PixelChunkData_t* pixel_output, int image_width, int image_height, bool* render_chunk, int chunk_size, const hittable& world, int max_depth, point3 camera_pos, point3 camera_looking_at, double vfov, int thread_limit = -1, const adaptive_settings* adaptive = nullptr) {
+			const int numberOfChunks = (int)(std::ceil(image_width / (float)chunk_size) * std::ceil(image_height / (float)chunk_size));
+
+			std::vector<chunk_work> work;
+			for (int i = 0; i < numberOfChunks; i++) {
+				if (render_chunk[i]) work.push_back({ i, 1 });
+			}
+
+			return renderWorldImageMCRT_ChunkWiseAsync(pixel_output, image_width, image_height, std::move(work), chunk_size, world, max_depth, camera_pos, camera_looking_at, vfov, thread_limit, adaptive);
+		}
+
+		/**
+		* Progressively render an image in chunks from a predefined world.
+		*/
+		void renderWorldImageMCRT_ChunkWise(PixelChunkData_t* pixel_output, int image_width, int image_height, bool* render_chunk, int chunk_size, const hittable& world, int max_depth, point3 camera_pos, point3 camera_looking_at, double vfov, int thread_limit = -1, const adaptive_settings* adaptive = nullptr) {
+			renderWorldImageMCRT_ChunkWiseAsync(pixel_output, image_width, image_height, render_chunk, chunk_size, world, max_depth, camera_pos, camera_looking_at, vfov, thread_limit, adaptive).wait();
 		}
 
 		void computeChunkedDifference(double* difference, color* curr, color* prev, int renderWidth, int renderHeight, int samplesPerPixel, int chunkSize, int chunksWide, int chunksTall) {
 
-			for (int cy = 0; cy < chunksTall; cy++) {
+			thread_pool::global().parallel_for(chunksTall, [&](int cy) {
 				for (int cx = 0; cx < chunksWide; cx++) {
 
 					int start_y = cy * chunkSize;
@@ -430,12 +778,12 @@ namespace RAYTRACING {
 
 					difference[cy * chunksWide + cx] = renderDifferenceSum / chunkPixelCount;
 				}
-			}
+			});
 		}
 
 		void computeChunkedDifference(double* difference, PixelChunkData_t* curr, PixelChunkData_t* prev, int size) {
 
-			for (int i = 0; i < size; i++) {
+			thread_pool::global().parallel_for(size, [&](int i) {
 
 				int width = curr[i].width;
 				int height = curr[i].height;
@@ -444,24 +792,24 @@ namespace RAYTRACING {
 				double renderDifferenceSum = 0;
 
 				for (int j = 0; j < number_of_pixels; j++) {
-					color diff = (correct_color_and_gamma(prev[i].pixel_data[j], prev[i].number_of_samples) - correct_color_and_gamma(curr[i].pixel_data[j], curr[i].number_of_samples));
+					color diff = (correct_color_and_gamma(prev[i].pixel_data[j], prev[i].sample_counts[j]) - correct_color_and_gamma(curr[i].pixel_data[j], curr[i].sample_counts[j]));
 
 					renderDifferenceSum += diff.length();
 				}
 
 				difference[i] = renderDifferenceSum / number_of_pixels;
-			}
+			});
 		}
 
 		void computeChunkNoise(double* noise, PixelChunkData_t* data, int size) {
-			for (int i = 0; i < size; i++) {
+			thread_pool::global().parallel_for(size, [&](int i) {
 
 				double noiseSum = 0;
 
 				std::vector<color> pixel_colors(data[i].number_of_pixels);
 
 				for (int j = 0; j < data[i].number_of_pixels; j++) {
-					pixel_colors[j] = correct_color_and_gamma(data[i].pixel_data[j], data[i].number_of_samples);
+					pixel_colors[j] = correct_color_and_gamma(data[i].pixel_data[j], data[i].sample_counts[j]);
 				}
 
 				for (int y = 0; y < data[i].height; y++) {
@@ -493,7 +841,7 @@ namespace RAYTRACING {
 				}
 
 				noise[i] = noiseSum / data[i].number_of_pixels;
-			}
+			});
 		}
 
 		void updateChunksToRender(bool* renderChunk, PixelChunkData_t* data, int max_samples, double threshold, double* difference, int size) {
@@ -502,25 +850,61 @@ namespace RAYTRACING {
 			}
 		}
 
-		void copyImage(color* source, color* destination, int size) {
+		/**
+		 * Per pixel stopping: a chunk stays active while its last adaptive pass left pixels that had not converged.
+		 * Only reads the chunk headers the render workers filled in.
+		*/
+		void updateChunksToRender(bool* renderChunk, const PixelChunkData_t* data, int size) {
 			for (int i = 0; i < size; i++) {
-				destination[i] = source[i];
+				renderChunk[i] = renderChunk[i] && data[i].active_pixels > 0;
 			}
 		}
 
+		void copyImage(color* source, color* destination, int size) {
+			thread_pool::global().parallel_for(size, [&](int i) {
+				destination[i] = source[i];
+			}, -1, 4096);
+		}
+
 		void copyImage(PixelChunkData_t* source, PixelChunkData_t* destination, int size) {
-			for (int i = 0; i < size; i++) {
+			thread_pool::global().parallel_for(size, [&](int i) {
 
 				if (destination[i].number_of_pixels != source[i].number_of_pixels) {
 					throw std::runtime_error("ERROR: pixel data must be of same length");
 				}
 
 				destination[i].number_of_samples = source[i].number_of_samples;
+				destination[i].active_pixels = source[i].active_pixels;
+				destination[i].noise = source[i].noise;
+				destination[i].sample_ms = source[i].sample_ms;
+				destination[i].epoch = source[i].epoch;
 
-				for (int j = 0; j < destination[i].number_of_pixels; j++) {
-					destination[i].pixel_data[j] = source[i].pixel_data[j];
-				}
+				std::memcpy((void*)destination[i].pixel_data, source[i].pixel_data, source[i].data_bytes);
+			});
+		}
+
+		/**
+		 * Copy only the chunks whose epoch differs between source and destination, the destination keeps the others as they are.
+		 * Both images must have been built with the same size and chunk size.
+		 * @return Number of chunks copied
+		*/
+		int copyChangedChunks(const PixelChunkData_t* source, PixelChunkData_t* destination, int size) {
+			std::vector<int> changed;
+			for (int i = 0; i < size; i++) {
+				if (destination[i].epoch != source[i].epoch) changed.push_back(i);
 			}
+
+			thread_pool::global().parallel_for((int)changed.size(), [&](int k) {
+				int i = changed[k];
+				destination[i].number_of_samples = source[i].number_of_samples;
+				destination[i].active_pixels = source[i].active_pixels;
+				destination[i].noise = source[i].noise;
+				destination[i].sample_ms = source[i].sample_ms;
+				destination[i].epoch = source[i].epoch;
+				std::memcpy((void*)destination[i].pixel_data, source[i].pixel_data, source[i].data_bytes);
+			});
+
+			return (int)changed.size();
 		}
 	}
 }
@@ -6,6 +6,9 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <bit>
 
 namespace RAYTRACING {
 
@@ -28,13 +31,84 @@ namespace RAYTRACING {
 			return degrees * pi / 180.0;
 		}
 
+		/**
+		 * xoshiro256++ random number generator. It is small enough to keep one per thread or per path,
+		 * so render threads never share generator state.
+		*/
+		class sampler {
+		public:
+			/**
+			 * @param seed Seed of the sequence
+			 * @param stream Selects an independent sequence for the same seed, e.g. a chunk or pixel index
+			*/
+			explicit sampler(uint64_t seed = 0, uint64_t stream = 0) {
+				// The state is filled with splitmix64 as recommended by the xoshiro authors, it must not be all zero
+				uint64_t x = seed ^ splitmix64(stream + 0x9E3779B97F4A7C15ull);
+				for (int i = 0; i < 4; i++) {
+					x += 0x9E3779B97F4A7C15ull;
+					state[i] = splitmix64(x);
+				}
+			}
+
+			uint64_t next_u64() {
+				const uint64_t result = std::rotl(state[0] + state[3], 23) + state[0];
+				const uint64_t t = state[1] << 17;
+
+				state[2] ^= state[0];
+				state[3] ^= state[1];
+				state[1] ^= state[2];
+				state[0] ^= state[3];
+				state[2] ^= t;
+				state[3] = std::rotl(state[3], 45);
+
+				return result;
+			}
+
+			/**
+			 * Random real in [0,1) with 53 random bits.
+			*/
+			double next_double() {
+				return (next_u64() >> 11) * 0x1.0p-53;
+			}
+
+			double next_double(double min, double max) {
+				return min + (max - min) * next_double();
+			}
+
+			static uint64_t splitmix64(uint64_t x) {
+				x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+				x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+				return x ^ (x >> 31);
+			}
+
+		private:
+			uint64_t state[4];
+		};
+
+		/**
+		 * Generator of the calling thread. Threads get distinct sequences in the order they first use it,
+		 * so the main thread always starts from the same one.
+		*/
+		inline sampler& thread_sampler() {
+			static std::atomic<uint64_t> next_thread_seed{ 0 };
+			thread_local sampler thread_local_sampler(0x5EED, next_thread_seed.fetch_add(1, std::memory_order_relaxed));
+			return thread_local_sampler;
+		}
+
+		/**
+		 * Restart the calling thread's generator, e.g. to get the same random scene every time.
+		*/
+		inline void seed_random(uint64_t seed) {
+			thread_sampler() = sampler(seed);
+		}
+
 		inline double random_double() {
-			// Returns a random real in [0,1]
-			return rand() / (RAND_MAX + 1.0);
+			// Returns a random real in [0,1)
+			return thread_sampler().next_double();
 		}
 
 		inline double random_double(double min, double max) {
-			// Returns a random real in [min,max]
+			// Returns a random real in [min,max)
 			return min + (max - min) * random_double();
 		}
 
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifndef SIMD_H
+#define SIMD_H
+
+// SSE2 is part of x86-64, so it is always available there without extra compiler flags.
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define RT_SIMD_SSE 1
+#include <emmintrin.h>
+#else
+#define RT_SIMD_SSE 0
+#endif
+
+// Wider kernels are compiled per function and picked at runtime with cpu_has_avx2(), so the build needs no -mavx2.
+// MSVC accepts AVX2 intrinsics in any function and has no target attribute.
+#if RT_SIMD_SSE
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define RT_TARGET_AVX2
+#define RT_FORCE_INLINE __forceinline
+#else
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#define RT_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+#endif
+
+#ifndef RT_FORCE_INLINE
+#define RT_FORCE_INLINE inline
+#endif
+
+#include <cmath>
+#include <limits>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Round a double to the nearest float that is not greater than it, so float bounds stay conservative.
+		*/
+		inline float float_round_down(double value) {
+			float f = (float)value;
+			return (double)f > value ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+		}
+
+		/**
+		 * Round a double to the nearest float that is not less than it.
+		*/
+		inline float float_round_up(double value) {
+			float f = (float)value;
+			return (double)f < value ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+		}
+
+		/**
+		 * True if the CPU and the OS support AVX2. Checked once.
+		*/
+		inline bool cpu_has_avx2() {
+#if !RT_SIMD_SSE
+			return false;
+#elif defined(_MSC_VER) && !defined(__clang__)
+			static const bool supported = []() {
+				int info[4];
+				__cpuid(info, 0);
+				if (info[0] < 7) return false;
+
+				// AVX needs the OS to save the ymm registers
+				__cpuid(info, 1);
+				if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+				if ((_xgetbv(0) & 6) != 6) return false;
+
+				__cpuidex(info, 7, 0);
+				return (info[1] & (1 << 5)) != 0;
+			}();
+			return supported;
+#else
+			static const bool supported = __builtin_cpu_supports("avx2");
+			return supported;
+#endif
+		}
+
+	}
+}
+
+#endif // !SIMD_H
@@ -23,6 +23,7 @@ namespace RAYTRACING {
 			};
 
 			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			virtual bool bounding_box(aabb& output_box) const override;
 
 		public:
 			point3 center;
@@ -52,12 +53,22 @@ namespace RAYTRACING {
 			rec.p = r.at(rec.t);
 			vec3 outward_normal = (rec.p - center) / radius;
 			rec.set_face_normal(r, outward_normal);
-			rec.mat_ptr = mat_ptr;
+			rec.mat_ptr = mat_ptr.get();
+			// The record may still hold the packed material of a farther hit on a compiled scene
+			rec.packed_mat = nullptr;
+			rec.material_index = no_material_index;
 
 			return true;
 
 		}
 
+		bool sphere::bounding_box(aabb& output_box) const {
+			// Hollow spheres use a negative radius
+			vec3 extent(fabs(radius), fabs(radius), fabs(radius));
+			output_box = aabb(center - extent, center + extent);
+			return true;
+		}
+
 	}
 }
 
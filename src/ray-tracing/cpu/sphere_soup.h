@@ -0,0 +1,335 @@
+#pragma once
+
+#ifndef SPHERE_SOUP_H
+#define SPHERE_SOUP_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "primitive.h"
+#include "simd.h"
+
+#include "../../utility/tracelog.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		// Spheres one soup kernel iteration tests
+		constexpr int sphere_soup_width = 8;
+		// Floats the soup arrays need past their last sphere, so a full width load from any sphere stays in bounds
+		constexpr int sphere_soup_padding = sphere_soup_width - 1;
+
+		// Fewest spheres worth the float test, smaller ranges are tested one by one in double precision. The float test is a
+		// long dependency chain ending in a branch, which only pays off when it rules out enough spheres at once.
+		constexpr int sphere_soup_min_count = 6;
+
+		// Relative size of the float rounding margin, several times the float epsilon
+		constexpr float sphere_soup_margin = 1e-6f;
+
+		/**
+		 * Spheres in structure of arrays layout, floats for a first test of many spheres at once and the double precision
+		 * spheres to refine the candidates it finds. All arrays are in the same order, the float arrays have
+		 * sphere_soup_padding readable entries past the end.
+		*/
+		struct sphere_soup_view {
+			const float* center_x = nullptr;
+			const float* center_y = nullptr;
+			const float* center_z = nullptr;
+			const float* radius = nullptr; // Absolute radius widened by its float rounding, see sphere_soup_radius
+			const compiled_sphere* spheres = nullptr;
+		};
+
+		/**
+		 * Radius to store in a soup: a float no smaller than the sphere that also covers the rounding of the center to float.
+		*/
+		inline float sphere_soup_radius(const compiled_sphere& s) {
+			double r = std::fabs(s.radius);
+			double center = std::max({ std::fabs(s.center.x()), std::fabs(s.center.y()), std::fabs(s.center.z()) });
+			return float_round_up(r + sphere_soup_margin * (r + center));
+		}
+
+		/**
+		 * The ray of a soup test in float, with a unit direction so distances along it need no scaling per sphere.
+		 * Set up by the first test that needs it, as many rays only reach ranges tested in double precision.
+		*/
+		struct sphere_soup_ray {
+			float origin_x, origin_y, origin_z;
+			float direction_x, direction_y, direction_z;
+			float length;        // Of the original direction, converts ray parameters to distances
+			float origin_margin; // Covers the rounding of the origin to float
+			bool ready = false;
+
+			void prepare(const primitive_ray& pr) {
+				double length_d = std::sqrt(pr.direction_length_squared);
+				double inverse_length = 1.0 / length_d;
+				origin_x = (float)pr.origin.x(); origin_y = (float)pr.origin.y(); origin_z = (float)pr.origin.z();
+				direction_x = (float)(pr.direction.x() * inverse_length); direction_y = (float)(pr.direction.y() * inverse_length); direction_z = (float)(pr.direction.z() * inverse_length);
+				length = (float)length_d;
+				origin_margin = sphere_soup_margin * std::max({ std::fabs(origin_x), std::fabs(origin_y), std::fabs(origin_z) });
+				ready = true;
+			}
+		};
+
+		namespace sphere_soup_detail {
+
+			/**
+			 * Refine the candidates of a soup test in double precision, nearest entry first. Once a candidate enters its
+			 * sphere beyond the closest hit so far, so do all that are left, so most rays refine a single sphere. The
+			 * nearest is picked without data dependent branches, which would mispredict behind the long float test.
+			 * @param entry Lower bound of the distance at which sphere first + i is hit, infinity if it is not a candidate
+			*/
+			template<int Width>
+			RT_FORCE_INLINE bool refine(const sphere_soup_view& soup, int first, float* entry, const primitive_ray& pr, const sphere_soup_ray& r, double t_min, double& closest, int& primitive) {
+				bool hit_anything = false;
+				while (true) {
+					int nearest = 0;
+					for (int lane = 1; lane < Width; lane++) nearest = entry[lane] < entry[nearest] ? lane : nearest;
+
+					const float infinite = std::numeric_limits<float>::infinity();
+					if (entry[nearest] == infinite || (double)entry[nearest] > closest * r.length) break;
+					entry[nearest] = infinite;
+
+					if (primitive_traits<sphere>::intersect(soup.spheres[first + nearest], pr, t_min, closest)) {
+						primitive = first + nearest;
+						hit_anything = true;
+					}
+				}
+				return hit_anything;
+			}
+
+			inline bool hit_scalar(const sphere_soup_view& soup, int first, int count, const primitive_ray& pr, double t_min, double& closest, int& primitive) {
+				bool hit_anything = false;
+				for (int i = first; i < first + count; i++) {
+					if (primitive_traits<sphere>::intersect(soup.spheres[i], pr, t_min, closest)) {
+						primitive = i;
+						hit_anything = true;
+					}
+				}
+				return hit_anything;
+			}
+
+#if RT_SIMD_SSE
+			/**
+			 * Conservative float test of four spheres. A sphere passes if the ray line comes within its widened radius and
+			 * the chord it cuts overlaps [near_distance, far_distance]. The widening grows with the distance along the ray,
+			 * so far spheres are not lost to float cancellation.
+			 * @param valid Lanes that hold spheres of the range
+			 * @param entry Receives for each sphere that passes a lower bound of the distance at which it is hit, infinity for the others
+			 * @return Bit i set if sphere first + i passes
+			*/
+			inline uint32_t candidates_sse(const sphere_soup_view& soup, int first, const sphere_soup_ray& r, __m128 near_distance, __m128 far_distance, __m128 valid, float* entry) {
+				const __m128 sign_mask = _mm_set1_ps(-0.0f);
+
+				__m128 ocx = _mm_sub_ps(_mm_loadu_ps(soup.center_x + first), _mm_set1_ps(r.origin_x));
+				__m128 ocy = _mm_sub_ps(_mm_loadu_ps(soup.center_y + first), _mm_set1_ps(r.origin_y));
+				__m128 ocz = _mm_sub_ps(_mm_loadu_ps(soup.center_z + first), _mm_set1_ps(r.origin_z));
+
+				__m128 dx = _mm_set1_ps(r.direction_x), dy = _mm_set1_ps(r.direction_y), dz = _mm_set1_ps(r.direction_z);
+				__m128 along = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+
+				__m128 px = _mm_sub_ps(ocx, _mm_mul_ps(along, dx));
+				__m128 py = _mm_sub_ps(ocy, _mm_mul_ps(along, dy));
+				__m128 pz = _mm_sub_ps(ocz, _mm_mul_ps(along, dz));
+				__m128 perpendicular2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz));
+
+				__m128 margin = _mm_add_ps(_mm_set1_ps(r.origin_margin), _mm_mul_ps(_mm_andnot_ps(sign_mask, along), _mm_set1_ps(sphere_soup_margin)));
+				__m128 reach = _mm_add_ps(_mm_loadu_ps(soup.radius + first), margin);
+
+				__m128 half_chord2 = _mm_sub_ps(_mm_mul_ps(reach, reach), perpendicular2);
+				__m128 half_chord = _mm_add_ps(_mm_sqrt_ps(_mm_max_ps(half_chord2, _mm_setzero_ps())), margin);
+				__m128 enter = _mm_sub_ps(along, half_chord);
+				__m128 exit = _mm_add_ps(along, half_chord);
+
+				__m128 crossed = _mm_cmpge_ps(half_chord2, _mm_setzero_ps());
+				__m128 ahead = _mm_cmpge_ps(exit, near_distance);
+				__m128 before = _mm_cmple_ps(enter, far_distance);
+
+				__m128 candidate = _mm_and_ps(_mm_and_ps(crossed, ahead), _mm_and_ps(before, valid));
+				__m128 infinite = _mm_set1_ps(std::numeric_limits<float>::infinity());
+				_mm_storeu_ps(entry, _mm_or_ps(_mm_and_ps(candidate, _mm_max_ps(enter, near_distance)), _mm_andnot_ps(candidate, infinite)));
+				return (uint32_t)_mm_movemask_ps(candidate);
+			}
+
+			inline bool hit_sse(const sphere_soup_view& soup, int first, int count, const primitive_ray& pr, const sphere_soup_ray& r, double t_min, double& closest, int& primitive) {
+				bool hit_anything = false;
+				const __m128 near_distance = _mm_set1_ps((float)(t_min * r.length));
+				float entry[4];
+
+				for (int block = first; block < first + count; block += 4) {
+					const __m128 valid = _mm_cmplt_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps((float)(first + count - block)));
+					const __m128 far_distance = _mm_set1_ps((float)(closest * r.length));
+
+					// Most blocks have no candidate, a branch on that predicts well
+					if (candidates_sse(soup, block, r, near_distance, far_distance, valid, entry) && refine<4>(soup, block, entry, pr, r, t_min, closest, primitive)) hit_anything = true;
+				}
+				return hit_anything;
+			}
+
+			/**
+			 * candidates_sse for eight spheres.
+			*/
+			RT_TARGET_AVX2 RT_FORCE_INLINE uint32_t candidates_avx2(const sphere_soup_view& soup, int first, const sphere_soup_ray& r, __m256 near_distance, __m256 far_distance, __m256 valid, float* entry) {
+				const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+
+				__m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(soup.center_x + first), _mm256_set1_ps(r.origin_x));
+				__m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(soup.center_y + first), _mm256_set1_ps(r.origin_y));
+				__m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(soup.center_z + first), _mm256_set1_ps(r.origin_z));
+
+				__m256 dx = _mm256_set1_ps(r.direction_x), dy = _mm256_set1_ps(r.direction_y), dz = _mm256_set1_ps(r.direction_z);
+				__m256 along = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+
+				__m256 px = _mm256_sub_ps(ocx, _mm256_mul_ps(along, dx));
+				__m256 py = _mm256_sub_ps(ocy, _mm256_mul_ps(along, dy));
+				__m256 pz = _mm256_sub_ps(ocz, _mm256_mul_ps(along, dz));
+				__m256 perpendicular2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)), _mm256_mul_ps(pz, pz));
+
+				__m256 margin = _mm256_add_ps(_mm256_set1_ps(r.origin_margin), _mm256_mul_ps(_mm256_andnot_ps(sign_mask, along), _mm256_set1_ps(sphere_soup_margin)));
+				__m256 reach = _mm256_add_ps(_mm256_loadu_ps(soup.radius + first), margin);
+
+				__m256 half_chord2 = _mm256_sub_ps(_mm256_mul_ps(reach, reach), perpendicular2);
+				__m256 half_chord = _mm256_add_ps(_mm256_sqrt_ps(_mm256_max_ps(half_chord2, _mm256_setzero_ps())), margin);
+				__m256 enter = _mm256_sub_ps(along, half_chord);
+				__m256 exit = _mm256_add_ps(along, half_chord);
+
+				__m256 crossed = _mm256_cmp_ps(half_chord2, _mm256_setzero_ps(), _CMP_GE_OQ);
+				__m256 ahead = _mm256_cmp_ps(exit, near_distance, _CMP_GE_OQ);
+				__m256 before = _mm256_cmp_ps(enter, far_distance, _CMP_LE_OQ);
+
+				__m256 candidate = _mm256_and_ps(_mm256_and_ps(crossed, ahead), _mm256_and_ps(before, valid));
+				_mm256_storeu_ps(entry, _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), _mm256_max_ps(enter, near_distance), candidate));
+				return (uint32_t)_mm256_movemask_ps(candidate);
+			}
+
+			RT_TARGET_AVX2 inline bool hit_avx2(const sphere_soup_view& soup, int first, int count, const primitive_ray& pr, const sphere_soup_ray& r, double t_min, double& closest, int& primitive) {
+				bool hit_anything = false;
+				const __m256 near_distance = _mm256_set1_ps((float)(t_min * r.length));
+				float entry[sphere_soup_width];
+
+				for (int block = first; block < first + count; block += sphere_soup_width) {
+					const __m256 valid = _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps((float)(first + count - block)), _CMP_LT_OQ);
+					const __m256 far_distance = _mm256_set1_ps((float)(closest * r.length));
+
+					if (candidates_avx2(soup, block, r, near_distance, far_distance, valid, entry) && refine<sphere_soup_width>(soup, block, entry, pr, r, t_min, closest, primitive)) hit_anything = true;
+				}
+				return hit_anything;
+			}
+#endif
+
+		}
+
+		/**
+		 * Nearest hit of a ray among count spheres of a soup starting at first. The spheres are tested 8 at a time in
+		 * float with AVX2, 4 at a time with SSE, and only the candidates that pass are intersected in double precision,
+		 * so the result is the same as testing every sphere in double precision.
+		 * @param r Float form of pr, set up here on first use
+		 * @param closest Far limit of the ray, shrunk to the hit distance
+		 * @param primitive Set to the index in soup.spheres of the closest hit
+		 * @return true if a sphere was hit closer than closest
+		*/
+		inline bool hit_sphere_soup(const sphere_soup_view& soup, int first, int count, const primitive_ray& pr, sphere_soup_ray& r, double t_min, double& closest, int& primitive) {
+#if RT_SIMD_SSE
+			if (count < sphere_soup_min_count) return sphere_soup_detail::hit_scalar(soup, first, count, pr, t_min, closest, primitive);
+			if (!r.ready) r.prepare(pr);
+
+			if (cpu_has_avx2()) return sphere_soup_detail::hit_avx2(soup, first, count, pr, r, t_min, closest, primitive);
+			return sphere_soup_detail::hit_sse(soup, first, count, pr, r, t_min, closest, primitive);
+#else
+			(void)r;
+			return sphere_soup_detail::hit_scalar(soup, first, count, pr, t_min, closest, primitive);
+#endif
+		}
+
+		/**
+		 * Spheres tested by brute force with the soup kernels, for scenes too small to be worth a bvh (e.g. scene_a()).
+		 * Keeps its own copies of the spheres, objects that are not spheres are skipped.
+		*/
+		class sphere_soup : public hittable {
+		public:
+			sphere_soup() {}
+			sphere_soup(const hittable_list& list) { build(list); }
+
+			void build(const hittable_list& list) {
+				spheres.clear();
+				materials.clear();
+				packed_materials.clear();
+				bounds = aabb();
+
+				for (const auto& object : list.objects) {
+					const sphere* s = dynamic_cast<const sphere*>(object.get());
+					if (!s) {
+						Tracelog::Warning("sphere_soup: skipping an object that is not a sphere");
+						continue;
+					}
+
+					uint32_t material = (uint32_t)materials.size();
+					materials.push_back(s->mat_ptr);
+					packed_materials.push_back(s->mat_ptr->pack());
+					spheres.push_back(primitive_traits<sphere>::compile(*s, material));
+
+					aabb box;
+					s->bounding_box(box);
+					bounds.expand(box);
+				}
+
+				const int padded = (int)spheres.size() + sphere_soup_padding;
+				center_x.assign(padded, 0.0f);
+				center_y.assign(padded, 0.0f);
+				center_z.assign(padded, 0.0f);
+				radius.assign(padded, 0.0f);
+				for (size_t i = 0; i < spheres.size(); i++) {
+					center_x[i] = (float)spheres[i].center.x();
+					center_y[i] = (float)spheres[i].center.y();
+					center_z[i] = (float)spheres[i].center.z();
+					radius[i] = sphere_soup_radius(spheres[i]);
+				}
+			}
+
+			virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+				const primitive_ray pr(r);
+				sphere_soup_ray soup_ray;
+				double closest = t_max;
+				int primitive = 0;
+
+				if (!hit_sphere_soup(view(), 0, (int)spheres.size(), pr, soup_ray, t_min, closest, primitive)) return false;
+
+				// Only the closest hit gets its surface
+				const compiled_sphere& s = spheres[primitive];
+				primitive_traits<sphere>::surface(s, pr, closest, rec);
+				rec.mat_ptr = materials[s.material].get();
+				rec.packed_mat = &packed_materials[s.material];
+				rec.material_index = no_material_index;
+				return true;
+			}
+
+			virtual bool bounding_box(aabb& output_box) const override {
+				if (spheres.empty()) return false;
+				output_box = bounds;
+				return true;
+			}
+
+			sphere_soup_view view() const {
+				return { center_x.data(), center_y.data(), center_z.data(), radius.data(), spheres.data() };
+			}
+
+		public:
+			std::vector<float> center_x, center_y, center_z, radius;
+			std::vector<compiled_sphere> spheres;
+			std::vector<shared_ptr<material>> materials;
+			std::vector<packed_material> packed_materials;
+			aabb bounds;
+		};
+
+	}
+}
+
+#endif // !SPHERE_SOUP_H
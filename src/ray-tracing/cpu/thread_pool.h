@@ -0,0 +1,412 @@
+#pragma once
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		class parallel_job;
+
+		/**
+		 * Persistent pool of worker threads. Every worker owns a task deque: it takes its own tasks newest first and steals
+		 * the oldest tasks of the other workers when it runs dry. Threads that wait for work they submitted help run tasks,
+		 * so nested parallel_for calls cannot deadlock.
+		*/
+		class thread_pool {
+		public:
+			/**
+			 * @param worker_count Number of worker threads, -1 for one less than the hardware threads since the caller helps.
+			 * With zero workers everything runs on the calling thread
+			 * @param pin_workers Pin each worker to its own core (Linux only, ignored elsewhere)
+			*/
+			explicit thread_pool(int worker_count = -1, bool pin_workers = true) {
+				int hardware_threads = (int)std::thread::hardware_concurrency();
+				if (hardware_threads < 1) hardware_threads = 1;
+				if (worker_count < 0) worker_count = std::max(1, hardware_threads - 1);
+
+				queue_count = worker_count;
+				queues = std::make_unique<worker_queue[]>(worker_count);
+
+				for (int i = 0; i < worker_count; i++) {
+					workers.emplace_back([this, i]() { worker_loop(i); });
+
+#if defined(__linux__)
+					if (pin_workers) {
+						// Core 0 is left to the thread that drives the pool
+						cpu_set_t cpus;
+						CPU_ZERO(&cpus);
+						CPU_SET((i + 1) % hardware_threads, &cpus);
+						pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpus), &cpus);
+					}
+#else
+					(void)pin_workers;
+#endif
+				}
+			}
+
+			thread_pool(const thread_pool&) = delete;
+			thread_pool& operator=(const thread_pool&) = delete;
+
+			~thread_pool() {
+				{
+					std::lock_guard<std::mutex> lock(sleep_lock);
+					stopping = true;
+				}
+				wake.notify_all();
+
+				for (auto& worker : workers) {
+					worker.join();
+				}
+			}
+
+			/**
+			 * Pool shared by the renderers, the post passes and the bvh builders. Created on first use.
+			*/
+			static thread_pool& global() {
+				static thread_pool pool;
+				return pool;
+			}
+
+			int size() const { return queue_count; }
+
+			/**
+			 * Queue a task. Tasks submitted from a worker go to its own deque, others are spread round robin.
+			*/
+			void submit(std::function<void()> task) {
+				if (size() == 0) {
+					task();
+					return;
+				}
+
+				int queue_index = current_pool == this ? current_worker : (int)(next_queue++ % (unsigned)size());
+
+				{
+					std::lock_guard<std::mutex> lock(queues[queue_index].lock);
+					queues[queue_index].tasks.push_back(std::move(task));
+				}
+				{
+					std::lock_guard<std::mutex> lock(sleep_lock);
+					queued++;
+				}
+				wake.notify_one();
+			}
+
+			/**
+			 * Run one queued task on the calling thread, if there is one.
+			 * @return false if every deque was empty
+			*/
+			bool run_one() {
+				std::function<void()> task;
+				if (!try_pop(current_pool == this ? current_worker : 0, task)) return false;
+				task();
+				return true;
+			}
+
+			/**
+			 * Call fn(i) for every i in [0, count) and return when all calls are done. The calling thread takes part,
+			 * indices are handed out in blocks of grain through one atomic counter.
+			 * The first exception thrown by fn is rethrown here after the other calls have finished.
+			 * @param thread_limit Maximum number of threads working on the loop, including the caller. -1 for no limit
+			*/
+			template<typename F>
+			void parallel_for(int count, F&& fn, int thread_limit = -1, int grain = 1) {
+				if (count <= 0) return;
+				if (grain < 1) grain = 1;
+
+				int runners = std::min(size() + 1, (count + grain - 1) / grain);
+				if (thread_limit > 0) runners = std::min(runners, thread_limit);
+
+				if (runners <= 1) {
+					for (int i = 0; i < count; i++) fn(i);
+					return;
+				}
+
+				std::atomic<int> next_index = 0;
+				std::exception_ptr error;
+				std::mutex error_lock;
+
+				auto run = [&]() {
+					try {
+						while (true) {
+							int begin = next_index.fetch_add(grain);
+							if (begin >= count) break;
+
+							int end = std::min(count, begin + grain);
+							for (int i = begin; i < end; i++) fn(i);
+						}
+					}
+					catch (...) {
+						std::lock_guard<std::mutex> lock(error_lock);
+						if (!error) error = std::current_exception();
+						next_index = count; // Stop handing out work
+					}
+				};
+
+				task_group group(runners - 1);
+				for (int r = 1; r < runners; r++) {
+					submit([&run, &group]() {
+						run();
+						group.done();
+					});
+				}
+
+				run();
+				wait(group);
+
+				if (error) std::rethrow_exception(error);
+			}
+
+			/**
+			 * Start fn(i) for every i in [0, count) on the workers and return straight away. The calling thread does not take part
+			 * until it waits on the returned job. fn is kept by the job, anything it references has to outlive the job.
+			 * @param thread_limit Maximum number of workers on the loop, -1 for no limit
+			*/
+			std::shared_ptr<parallel_job> parallel_for_async(int count, std::function<void(int)> fn, int thread_limit = -1, int grain = 1);
+
+			/**
+			 * Counts outstanding tasks so a thread can wait for them with wait().
+			*/
+			class task_group {
+			public:
+				explicit task_group(int task_count) : remaining(task_count) {}
+
+				void done() {
+					// Held across the decrement so a waiter cannot see zero and destroy the group while it is still being notified
+					std::lock_guard<std::mutex> guard(lock);
+					if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+						finished.notify_all();
+					}
+				}
+
+				bool is_done() const { return remaining.load(std::memory_order_acquire) == 0; }
+
+			private:
+				friend class thread_pool;
+
+				std::atomic<int> remaining;
+				std::mutex lock;
+				std::condition_variable finished;
+			};
+
+			/**
+			 * Help with queued tasks until the group is done, then sleep on it once there is nothing left to help with.
+			*/
+			void wait(task_group& group) {
+				while (!group.is_done()) {
+					if (run_one()) continue;
+
+					std::unique_lock<std::mutex> lock(group.lock);
+					// Wakes as soon as the group is done, the timeout only picks up tasks that nested loops queue in the meantime
+					group.finished.wait_for(lock, std::chrono::milliseconds(1), [&group]() { return group.is_done(); });
+				}
+
+				// The last done() may still hold the lock
+				std::lock_guard<std::mutex> guard(group.lock);
+			}
+
+		private:
+			struct alignas(64) worker_queue {
+				std::mutex lock;
+				std::deque<std::function<void()>> tasks;
+			};
+
+			bool try_pop(int own_index, std::function<void()>& task) {
+				const int count = size();
+
+				for (int k = 0; k < count; k++) {
+					int index = (own_index + k) % count;
+					worker_queue& queue = queues[index];
+
+					std::lock_guard<std::mutex> lock(queue.lock);
+					if (queue.tasks.empty()) continue;
+
+					// Own tasks newest first for cache reuse, stolen tasks oldest first since they tend to be the largest
+					if (k == 0 && current_pool == this) {
+						task = std::move(queue.tasks.back());
+						queue.tasks.pop_back();
+					}
+					else {
+						task = std::move(queue.tasks.front());
+						queue.tasks.pop_front();
+					}
+
+					queued--;
+					return true;
+				}
+
+				return false;
+			}
+
+			void worker_loop(int index) {
+				current_pool = this;
+				current_worker = index;
+
+				std::function<void()> task;
+				while (true) {
+					if (try_pop(index, task)) {
+						task();
+						task = nullptr;
+						continue;
+					}
+
+					std::unique_lock<std::mutex> lock(sleep_lock);
+					wake.wait(lock, [this]() { return stopping || queued > 0; });
+					if (stopping && queued == 0) return;
+				}
+			}
+
+			std::vector<std::thread> workers;
+			std::unique_ptr<worker_queue[]> queues;
+			int queue_count = 0; // Set before the workers start, unlike workers.size()
+
+			std::mutex sleep_lock;
+			std::condition_variable wake;
+			std::atomic<int> queued = 0;
+			bool stopping = false;
+
+			std::atomic<unsigned> next_queue = 0;
+
+			static inline thread_local thread_pool* current_pool = nullptr;
+			static inline thread_local int current_worker = 0;
+		};
+
+		/**
+		 * Loop started with thread_pool::parallel_for_async. Completion is signalled by the last worker to finish,
+		 * so waiting costs nothing once the work is done.
+		*/
+		class parallel_job {
+		public:
+			bool is_done() const { return done.load(std::memory_order_acquire); }
+
+			/**
+			 * Help with queued pool tasks until the loop is done. Rethrows the first exception thrown by the loop body.
+			*/
+			void wait() {
+				while (!is_done()) {
+					if (pool->run_one()) continue;
+
+					std::unique_lock<std::mutex> guard(lock);
+					finished.wait_for(guard, std::chrono::milliseconds(1), [this]() { return is_done(); });
+				}
+
+				if (error) std::rethrow_exception(error);
+			}
+
+			/**
+			 * Wait without helping the pool.
+			 * @return true if the loop finished within the timeout
+			*/
+			template<typename Rep, typename Period>
+			bool wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+				std::unique_lock<std::mutex> guard(lock);
+				return finished.wait_for(guard, timeout, [this]() { return is_done(); });
+			}
+
+			/**
+			 * Stop handing out indices. Calls that already started run to completion, the job is done once they have.
+			*/
+			void cancel() {
+				next_index = count;
+				cancelled.store(true, std::memory_order_relaxed);
+			}
+
+			bool is_cancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+			/**
+			 * Time from the start of the loop until it finished, or until now while it is still running.
+			*/
+			double elapsed_ms() const {
+				auto end = is_done() ? finish_time : std::chrono::steady_clock::now();
+				return std::chrono::duration<double, std::milli>(end - start_time).count();
+			}
+
+		private:
+			friend class thread_pool;
+
+			void run() {
+				try {
+					while (true) {
+						int begin = next_index.fetch_add(grain);
+						if (begin >= count) break;
+
+						int end = std::min(count, begin + grain);
+						for (int i = begin; i < end; i++) fn(i);
+					}
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> guard(lock);
+					if (!error) error = std::current_exception();
+					next_index = count;
+				}
+
+				if (remaining_runners.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					std::lock_guard<std::mutex> guard(lock);
+					finish_time = std::chrono::steady_clock::now();
+					done.store(true, std::memory_order_release);
+					finished.notify_all();
+				}
+			}
+
+			thread_pool* pool = nullptr;
+			std::function<void(int)> fn;
+			int count = 0;
+			int grain = 1;
+
+			std::atomic<int> next_index = 0;
+			std::atomic<int> remaining_runners = 0;
+			std::atomic<bool> done = false;
+			std::atomic<bool> cancelled = false;
+
+			std::mutex lock;
+			std::condition_variable finished;
+			std::exception_ptr error;
+
+			std::chrono::steady_clock::time_point start_time;
+			std::chrono::steady_clock::time_point finish_time;
+		};
+
+		inline std::shared_ptr<parallel_job> thread_pool::parallel_for_async(int count, std::function<void(int)> fn, int thread_limit, int grain) {
+			auto job = std::make_shared<parallel_job>();
+			job->pool = this;
+			job->fn = std::move(fn);
+			job->count = count > 0 ? count : 0;
+			job->grain = grain < 1 ? 1 : grain;
+			job->start_time = std::chrono::steady_clock::now();
+
+			int runners = std::min(size(), (job->count + job->grain - 1) / job->grain);
+			if (thread_limit > 0) runners = std::min(runners, thread_limit);
+			if (runners < 1) runners = 1;
+
+			job->remaining_runners = runners;
+
+			// Each runner holds a reference, so the job lives until the last one is done even if the caller drops it
+			for (int r = 0; r < runners; r++) {
+				submit([job]() { job->run(); });
+			}
+
+			return job;
+		}
+
+	}
+}
+
+#endif // !THREAD_POOL_H
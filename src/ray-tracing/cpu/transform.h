@@ -0,0 +1,146 @@
+#pragma once
+
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Affine transform stored as the top three rows of a 4x4 matrix, the last row is always (0, 0, 0, 1).
+		 * Transforms compose right to left like matrices: (a * b) applies b first.
+		*/
+		class transform {
+		public:
+			transform() : m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } {}
+
+			static transform translate(const vec3& offset) {
+				transform t;
+				t.m[0][3] = offset.x();
+				t.m[1][3] = offset.y();
+				t.m[2][3] = offset.z();
+				return t;
+			}
+
+			static transform scale(const vec3& factor) {
+				transform t;
+				t.m[0][0] = factor.x();
+				t.m[1][1] = factor.y();
+				t.m[2][2] = factor.z();
+				return t;
+			}
+
+			static transform scale(double factor) {
+				return scale(vec3(factor, factor, factor));
+			}
+
+			/**
+			 * Rotation around the y axis.
+			 * @param degrees Angle, counter clockwise when looking down the axis
+			*/
+			static transform rotate_y(double degrees) {
+				double radians = degrees_to_radians(degrees);
+				double s = sin(radians), c = cos(radians);
+
+				transform t;
+				t.m[0][0] = c;
+				t.m[0][2] = s;
+				t.m[2][0] = -s;
+				t.m[2][2] = c;
+				return t;
+			}
+
+			transform operator*(const transform& other) const {
+				transform t;
+				for (int row = 0; row < 3; row++) {
+					for (int col = 0; col < 4; col++) {
+						double value = col == 3 ? m[row][3] : 0.0;
+						for (int k = 0; k < 3; k++) {
+							value += m[row][k] * other.m[k][col];
+						}
+						t.m[row][col] = value;
+					}
+				}
+				return t;
+			}
+
+			/**
+			 * Inverse of the transform. The linear part has to be invertible (no zero scale).
+			*/
+			transform inverse() const {
+				const double a = m[0][0], b = m[0][1], c = m[0][2];
+				const double d = m[1][0], e = m[1][1], f = m[1][2];
+				const double g = m[2][0], h = m[2][1], i = m[2][2];
+
+				const double inv_det = 1.0 / (a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g));
+
+				transform t;
+				t.m[0][0] = (e * i - f * h) * inv_det;
+				t.m[0][1] = (c * h - b * i) * inv_det;
+				t.m[0][2] = (b * f - c * e) * inv_det;
+				t.m[1][0] = (f * g - d * i) * inv_det;
+				t.m[1][1] = (a * i - c * g) * inv_det;
+				t.m[1][2] = (c * d - a * f) * inv_det;
+				t.m[2][0] = (d * h - e * g) * inv_det;
+				t.m[2][1] = (b * g - a * h) * inv_det;
+				t.m[2][2] = (a * e - b * d) * inv_det;
+
+				// Translation is the negated original translation run through the inverse linear part
+				for (int row = 0; row < 3; row++) {
+					t.m[row][3] = -(t.m[row][0] * m[0][3] + t.m[row][1] * m[1][3] + t.m[row][2] * m[2][3]);
+				}
+				return t;
+			}
+
+			point3 apply_point(const point3& p) const {
+				return point3(
+					m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+					m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+					m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+			}
+
+			vec3 apply_vector(const vec3& v) const {
+				return vec3(
+					m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+					m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+					m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+			}
+
+			/**
+			 * Transform a normal with the transpose of this matrix. Call it on the inverse of the transform the geometry went through,
+			 * the result is not normalized.
+			*/
+			vec3 apply_normal_transposed(const vec3& n) const {
+				return vec3(
+					m[0][0] * n.x() + m[1][0] * n.y() + m[2][0] * n.z(),
+					m[0][1] * n.x() + m[1][1] * n.y() + m[2][1] * n.z(),
+					m[0][2] * n.x() + m[1][2] * n.y() + m[2][2] * n.z());
+			}
+
+			/**
+			 * Bounds of the transformed box, the box around its eight transformed corners.
+			*/
+			aabb apply_box(const aabb& box) const {
+				aabb result;
+				for (int corner = 0; corner < 8; corner++) {
+					point3 p(
+						corner & 1 ? box.maximum.x() : box.minimum.x(),
+						corner & 2 ? box.maximum.y() : box.minimum.y(),
+						corner & 4 ? box.maximum.z() : box.minimum.z());
+					result.expand(apply_point(p));
+				}
+				return result;
+			}
+
+		public:
+			double m[3][4];
+		};
+
+	}
+}
+
+#endif // !TRANSFORM_H
@@ -60,6 +60,14 @@ namespace RAYTRACING {
 				return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
 			}
 
+			inline static vec3 random(sampler& rng) {
+				return vec3(rng.next_double(), rng.next_double(), rng.next_double());
+			}
+
+			inline static vec3 random(double min, double max, sampler& rng) {
+				return vec3(rng.next_double(min, max), rng.next_double(min, max), rng.next_double(min, max));
+			}
+
 			/* Return true if the vector is close to zero in all dimensions. */
 			bool near_zero() const {
 				// Return true if the vector is close to zero in all dimensions.
@@ -126,18 +134,26 @@ namespace RAYTRACING {
 			return v / v.length();
 		}
 
-		vec3 random_in_unit_sphere() {
+		vec3 random_in_unit_sphere(sampler& rng) {
 			while (true) {
-				auto p = vec3::random(-1, 1);
+				auto p = vec3::random(-1, 1, rng);
 				if (p.length_squared() >= 1) continue;
 				return p;
 			}
 		}
 
+		vec3 random_in_unit_sphere() {
+			return random_in_unit_sphere(thread_sampler());
+		}
+
 		/** Diffuse function
 		 *  Use for true lambertain diffuse. */
+		vec3 random_unit_vector(sampler& rng) {
+			return unit_vector(random_in_unit_sphere(rng));
+		}
+
 		vec3 random_unit_vector() {
-			return unit_vector(random_in_unit_sphere());
+			return random_unit_vector(thread_sampler());
 		}
 
 		/* Alternative diffuse formulation */
@@ -172,14 +188,18 @@ namespace RAYTRACING {
 		/**
 		 * Generate random point inside unit disc.
 		*/
-		vec3 random_in_unit_disk() {
+		vec3 random_in_unit_disk(sampler& rng) {
 			while (true) {
-				auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+				auto p = vec3(rng.next_double(-1, 1), rng.next_double(-1, 1), 0);
 				if (p.length_squared() >= 1) continue;
 				return p;
 			}
 		}
 
+		vec3 random_in_unit_disk() {
+			return random_in_unit_disk(thread_sampler());
+		}
+
 	}
 }
 
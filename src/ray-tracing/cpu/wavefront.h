@@ -0,0 +1,236 @@
+#pragma once
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "material_batch.h"
+#include "path_tracing.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <typeindex>
+
+namespace RAYTRACING {
+
+	namespace CPU {
+
+		/**
+		 * Rays of one wavefront bounce in structure of arrays layout, one array per component.
+		 * slot is where the radiance a ray gathers goes.
+		*/
+		struct ray_stream {
+			std::vector<double> origin_x, origin_y, origin_z;
+			std::vector<double> direction_x, direction_y, direction_z;
+			std::vector<double> throughput_r, throughput_g, throughput_b;
+			std::vector<int> slot;
+			int count = 0;
+
+			void clear() { count = 0; }
+
+			/**
+			 * Make room for at least capacity rays, keeping the count.
+			*/
+			void reserve(int capacity) {
+				if ((int)slot.size() >= capacity) return;
+
+				for (std::vector<double>* component : { &origin_x, &origin_y, &origin_z, &direction_x, &direction_y, &direction_z, &throughput_r, &throughput_g, &throughput_b }) {
+					component->resize(capacity);
+				}
+				slot.resize(capacity);
+			}
+
+			void push(const ray& r, const color& throughput, int ray_slot) {
+				if (count == (int)slot.size()) reserve(std::max(256, count * 2));
+
+				origin_x[count] = r.orig.x(); origin_y[count] = r.orig.y(); origin_z[count] = r.orig.z();
+				direction_x[count] = r.dir.x(); direction_y[count] = r.dir.y(); direction_z[count] = r.dir.z();
+				throughput_r[count] = throughput.x(); throughput_g[count] = throughput.y(); throughput_b[count] = throughput.z();
+				slot[count] = ray_slot;
+				count++;
+			}
+
+			ray get_ray(int i) const {
+				return ray(point3(origin_x[i], origin_y[i], origin_z[i]), vec3(direction_x[i], direction_y[i], direction_z[i]));
+			}
+
+			color get_throughput(int i) const {
+				return color(throughput_r[i], throughput_g[i], throughput_b[i]);
+			}
+		};
+
+		/**
+		 * Traces batches of paths bounce by bounce instead of one path at a time. Every bounce runs as separate stages over
+		 * the whole batch: intersect all rays, sort the hits by material type, shade them in that order and compact the survivors
+		 * into the stream for the next bounce. Each stage runs one kind of code over contiguous data. Hits on the built in
+		 * materials of a compiled scene are shaded by the batch kernels of scatter_hits, other materials through their virtual
+		 * scatter, a type at a time so the calls stay predictable.
+		 * Keeps its buffers between batches, use one per thread (see thread_wavefront_tracer).
+		*/
+		class wavefront_tracer {
+		public:
+			/**
+			 * Stream to fill with the camera rays of the next batch, emptied by this call.
+			*/
+			ray_stream& begin_batch() {
+				current.clear();
+				return current;
+			}
+
+			/**
+			 * Trace every path of the batch to the end, adding the light a path gathers to radiance[slot].
+			 * @param max_depth Rays per path at most, as for ray_color
+			*/
+			void trace(const hittable& world, int max_depth, sampler& rng, color* radiance) {
+				for (int depth = 0; depth < max_depth && current.count > 0; depth++) {
+					intersect(world, radiance, depth == 0);
+					sort_by_material();
+					shade(depth + 1, rng);
+					std::swap(current, next);
+				}
+			}
+
+		private:
+			struct shade_item {
+				int kind; // A material_type below packed_material_types, else packed_material_types plus the index in kinds
+				int ray;
+			};
+
+			/**
+			 * Find the closest hit of every ray. Rays that escape gather the sky and end here.
+			 * @param coherent The rays are camera rays in tile order, traced in packets of ray_packet_size consecutive rays
+			*/
+			void intersect(const hittable& world, color* radiance, bool coherent) {
+				if ((int)hits.size() < current.count) hits.resize(current.count);
+				unsorted.clear();
+
+				ray packet[ray_packet_size];
+				bool hit[ray_packet_size];
+
+				for (int first = 0; first < current.count; first += ray_packet_size) {
+					const int count = std::min(ray_packet_size, current.count - first);
+					for (int j = 0; j < count; j++) packet[j] = current.get_ray(first + j);
+
+					if (coherent) {
+						world.hit_packet(packet, count, 0.001, infinity, &hits[first], hit);
+					}
+					else {
+						for (int j = 0; j < count; j++) hit[j] = world.hit(packet[j], 0.001, infinity, hits[first + j]);
+					}
+
+					for (int j = 0; j < count; j++) {
+						const int i = first + j;
+						if (hit[j]) {
+							const hit_record& rec = hits[i];
+							bool packed = rec.packed_mat && rec.packed_mat->type != material_type::virtual_call;
+							unsorted.push_back({ packed ? (int)rec.packed_mat->type : packed_material_types + material_kind(*rec.mat_ptr), i });
+						}
+						else {
+							radiance[current.slot[i]] += current.get_throughput(i) * sky_color(packet[j]);
+						}
+					}
+				}
+			}
+
+			/**
+			 * Group the hits by material type with a counting sort. Grouping by type rather than by material keeps
+			 * the rays of each type in their original order, so the next bounce starts out as coherent as this one.
+			*/
+			void sort_by_material() {
+				const int kind_count = packed_material_types + (int)kinds.size();
+
+				// Afterwards kind k is order[kind_start[k], kind_start[k + 1])
+				kind_start.assign(kind_count + 1, 0);
+				for (const shade_item& item : unsorted) kind_start[item.kind + 1]++;
+				for (int k = 1; k <= kind_count; k++) kind_start[k] += kind_start[k - 1];
+
+				order.resize(unsorted.size());
+				kind_fill.assign(kind_start.begin(), kind_start.end() - 1);
+				for (const shade_item& item : unsorted) order[kind_fill[item.kind]++] = item;
+			}
+
+			/**
+			 * Index of the material's type, the scatter it runs. A scene only has a handful of types.
+			*/
+			int material_kind(const material& mat) {
+				std::type_index type(typeid(mat));
+				for (size_t k = 0; k < kinds.size(); k++) {
+					if (kinds[k] == type) return (int)k;
+				}
+				kinds.push_back(type);
+				return (int)kinds.size() - 1;
+			}
+
+			/**
+			 * Scatter the hit rays in material order, the survivors are appended to the next stream in that order.
+			*/
+			void shade(int bounces, sampler& rng) {
+				next.clear();
+				next.reserve(current.count);
+
+				for (int kind = 0; kind < (int)kind_start.size() - 1; kind++) {
+					const int first = kind_start[kind];
+					const int count = kind_start[kind + 1] - first;
+					if (count == 0) continue;
+
+					if (kind < packed_material_types) {
+						batch.resize(count);
+						for (int j = 0; j < count; j++) {
+							const hit_record& rec = hits[order[first + j].ray];
+							batch.set(j, current.get_ray(order[first + j].ray), rec, *rec.packed_mat);
+						}
+
+						scatter_hits((material_type)kind, batch, rng);
+
+						for (int j = 0; j < count; j++) {
+							if (batch.alive[j] == 0.0) continue;
+							continue_ray(order[first + j].ray, batch.scattered(j), batch.attenuation(j), bounces, rng);
+						}
+					}
+					else {
+						for (int j = first; j < first + count; j++) {
+							const hit_record& rec = hits[order[j].ray];
+
+							ray scattered;
+							color attenuation;
+							if (!rec.mat_ptr->scatter(current.get_ray(order[j].ray), rec, attenuation, scattered, rng)) continue;
+
+							continue_ray(order[j].ray, scattered, attenuation, bounces, rng);
+						}
+					}
+				}
+			}
+
+			/**
+			 * Append the scattered ray to the next stream unless Russian roulette ends the path.
+			*/
+			void continue_ray(int i, const ray& scattered, const color& attenuation, int bounces, sampler& rng) {
+				color throughput = current.get_throughput(i) * attenuation;
+				if (!continue_path(throughput, bounces, rng)) return;
+
+				next.push(scattered, throughput, current.slot[i]);
+			}
+
+			ray_stream current, next;
+			std::vector<hit_record> hits;
+			std::vector<shade_item> unsorted, order;
+			std::vector<int> kind_start, kind_fill;
+			hit_batch batch;
+			std::vector<std::type_index> kinds; // Material types seen so far, kept between batches
+		};
+
+		/**
+		 * Tracer of the calling thread, so workers reuse their buffers from chunk to chunk.
+		*/
+		inline wavefront_tracer& thread_wavefront_tracer() {
+			thread_local wavefront_tracer tracer;
+			return tracer;
+		}
+
+	}
+}
+
+#endif // !WAVEFRONT_H